@@ -3,8 +3,16 @@
 #include <stdlib.h>
 #include <assert.h>
 
-#define UNEXPECTED_TOKEN(tzr, tkn) (fprintf(stderr, \
-	"unexpected token at line %d: [%d] ", tzr->lineno, __LINE__), dump_token(stderr, tkn), exit(1))
+#define UNEXPECTED_TOKEN(tzr, tkn) unexpected_token(tzr, tkn, __LINE__)
+
+_Noreturn static void unexpected_token(tokenizer *tzr, token tkn, int line) {
+	char *text = 0;
+	size_t len = 0;
+	FILE *out = open_memstream(&text, &len);
+	dump_token(out, tkn);
+	fclose(out);
+	die("unexpected token at line %d: [%d] %s", tzr->lineno, line, text);
+}
 
 token peek(tokenizer *tzr) {
 	if (!tzr->prev.kind)
@@ -38,7 +46,7 @@ token expect(tokenizer *tzr, token_kind k) {
 
 static ast_expression *parse_expression(tokenizer *tzr);
 static ast_primary *parse_primary(tokenizer *tzr) {
-	ast_primary *prim = malloc(sizeof(ast_primary));
+	ast_primary *prim = calloc(1, sizeof(ast_primary));
 	token tkn;
 
 again:
@@ -72,6 +80,28 @@ again:
 		}
 		break;
 
+	case TK_LBRACE:
+		prim->kind = AST_MAP;
+		cap = 4;
+		prim->amnt = 0;
+		prim->args = malloc(cap * sizeof(ast_expression *));
+		while (!guard(tzr, TK_RBRACE).kind) {
+			if (prim->amnt == cap)
+				prim->args = realloc(prim->args, (cap *= 2)*sizeof(ast_expression *));
+
+			if (!(prim->args[prim->amnt++] = parse_expression(tzr)))
+				UNEXPECTED_TOKEN(tzr, peek(tzr));
+			expect(tzr, TK_COLON);
+			if (!(prim->args[prim->amnt++] = parse_expression(tzr)))
+				UNEXPECTED_TOKEN(tzr, peek(tzr));
+
+			if (!guard(tzr, TK_COMMA).kind) {
+				expect(tzr, TK_RBRACE);
+				break;
+			}
+		}
+		break;
+
 	case TK_SUB:
 	case TK_NOT:
 		prim->kind = tkn.kind == TK_SUB ? AST_NEG : AST_NOT;
@@ -95,7 +125,7 @@ again:
 	}
 
 	while ((tkn = peek(tzr)).kind == TK_LBRACKET || tkn.kind == TK_LPAREN) {
-		ast_primary *prim2 = malloc(sizeof(ast_primary));
+		ast_primary *prim2 = calloc(1, sizeof(ast_primary));
 		prim2->prim = prim;
 		prim = prim2;
 
@@ -132,7 +162,7 @@ again:
 }
 
 static ast_expression *parse_expression(tokenizer *tzr) {
-	ast_expression *expr = malloc(sizeof(ast_expression));
+	ast_expression *expr = calloc(1, sizeof(ast_expression));
 	if (!(expr->prim = parse_primary(tzr))) {
 		free(expr);
 		return 0;
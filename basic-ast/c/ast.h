@@ -1,20 +1,27 @@
 #pragma once
+#include <stdbool.h>
 #include "value.h"
 #include "token.h"
 
 struct ast_declaration *next_declaration(tokenizer *tzr);
+void analyze_escapes(struct ast_block *block);
+bool var_escapes(struct ast_block *block, const char *name);
+void fuse_idioms(struct ast_block *block);
+void dump_fusion_stats(FILE *out);
+extern __thread unsigned long fusion_rewrites[4], fusion_hits[4]; // indexed by `kind - AST_INCR`, per thread
 
 typedef struct ast_primary {
 	enum {
 		AST_PAREN, AST_INDEX, AST_FNCALL,
-		AST_NEG, AST_NOT, AST_ARY, AST_VAR, AST_LITERAL
+		AST_NEG, AST_NOT, AST_ARY, AST_MAP, AST_VAR, AST_LITERAL
 	} kind;
+	bool scratch; // ary literal doesn't escape the full expression, see `escape.c`
 
 	union {
 		struct {
-			int amnt; // use in ary literal and fncall
+			int amnt; // use in ary literal, map literal (twice the pairs) and fncall
 			struct ast_primary *prim; // used in index, fncall, and neg/not.
-			struct ast_expression *expr, **args; // used in index & paren; used in ary literal and fncall
+			struct ast_expression *expr, **args; // used in index & paren; used in ary literal, map literal (key, value, ...) and fncall
 		};
 		char *ident; // used in var
 		value value; // used in literal
@@ -22,9 +29,15 @@ typedef struct ast_primary {
 } ast_primary;
 
 typedef struct ast_expression {
-	enum { AST_ASSIGN, AST_IDX_ASSIGN, AST_BINOP, AST_PRIM } kind;
+	enum {
+		AST_ASSIGN, AST_IDX_ASSIGN, AST_BINOP, AST_PRIM,
+		// fused forms of common idioms (see `fuse.c`). they're laid out exactly like an
+		// ASSIGN, BINOP, IDX_ASSIGN and ASSIGN respectively, so they can be treated as one.
+		AST_INCR, AST_LTH_LENGTH, AST_APPEND, AST_EXTEND
+	} kind;
 
 	token_kind binop;
+	bool scratch; // result of `+` doesn't escape the full expression
 	struct ast_expression *index, *rhs; // index used for index assign ; rhs used for both assigns and binop
 	union {
 		struct ast_primary *prim; // used in binop and idx assign
@@ -0,0 +1,189 @@
+#include "basicast.h"
+#include "token.h"
+#include "run.h"
+#include "memo.h"
+#include "closure.h"
+#ifdef BASICAST_JIT
+#include "jit.h"
+#endif
+#include <stdlib.h>
+
+/*
+ * The embedding API, see `basicast.h`.
+ *
+ * A context is an env and a heap (see `gc_new_heap`), and each load or call
+ * swaps its heap in for as long as it runs. Errors are `die`s like anywhere
+ * else, caught by pointing `die_handler` at the entry point's own jmp_buf; it
+ * then winds the env back to how the call found it: frames popped, scratch
+ * and extra gc roots let go. Whatever the interrupted call had malloc'd for
+ * itself (an engine's stack, a sort's buffer) is leaked.
+ *
+ * A program's parsed (and escape analysed and fused) once, by
+ * `basicast_parse`, and from then on its AST's only read: loading it into a
+ * context just makes that context's functions, which hold their own heat,
+ * memo and compiled closures. So contexts on different threads can share one,
+ * each with its heap and its share of the runtime's globals (see `die`, `gc`,
+ * `memos`) to itself.
+ */
+
+struct basicast {
+	env *e; // big, for the scratch region
+	heap *heap;
+	char **strings; // `basicast_string`'s
+	int nstrings, strings_cap;
+	char error[sizeof(die_message)];
+};
+
+struct basicast_program {
+	ast_declaration **decls;
+	int len;
+	char error[sizeof(die_message)];
+};
+
+// what an entry point changed, to put back on the way out.
+typedef struct {
+	jmp_buf jmp, *handler;
+	heap *heap;
+	int sp;
+	size_t scratch_len;
+	gc_roots *roots;
+} entry;
+
+// `stack_base` is the entry point's frame, so its locals get scanned for roots too.
+static void enter(basicast *b, entry *en, void *stack_base) {
+	en->heap = gc_use_heap(b->heap);
+	gc_init(b->e, stack_base);
+	en->handler = die_handler;
+	die_handler = &en->jmp;
+	en->sp = b->e->sp;
+	en->scratch_len = b->e->scratch_len;
+	en->roots = gc_top_roots();
+	b->error[0] = '\0';
+}
+
+static bool leave(basicast *b, entry *en, bool ok) {
+	if (!ok) {
+		env *e = b->e;
+		for (int sp = en->sp + 1; sp <= e->sp && sp < e->nframes; ++sp) {
+			map *locals = &e->stackframes[sp];
+			for (int i = 0; i < locals->len; ++i)
+				gc_release(locals->entries[i].v);
+			locals->len = 0;
+		}
+		e->sp = en->sp;
+		e->scratch_len = en->scratch_len;
+		gc_pop_roots(&(gc_roots) { .next = en->roots });
+		strcpy(b->error, die_message);
+	}
+	die_handler = en->handler;
+	gc_use_heap(en->heap);
+	return ok;
+}
+
+basicast *basicast_new(void) {
+	basicast *b = calloc(1, sizeof(basicast));
+	b->e = calloc(1, sizeof(env));
+	b->heap = gc_new_heap();
+	return b;
+}
+
+basicast_program *basicast_parse(const char *source) {
+	basicast_program *p = calloc(1, sizeof(basicast_program));
+	jmp_buf jmp, *handler = die_handler;
+	die_handler = &jmp;
+	if (setjmp(jmp)) {
+		strcpy(p->error, die_message);
+		p->len = 0;
+		die_handler = handler;
+		return p;
+	}
+
+	tokenizer tzr = new_tokenizer(source);
+	ast_declaration *d;
+	for (int cap = 0; (d = next_declaration(&tzr)); p->decls[p->len++] = d) {
+		prepare_declaration(d);
+		if (p->len == cap)
+			p->decls = realloc(p->decls, (cap = cap ? 2 * cap : 16) * sizeof(ast_declaration *));
+	}
+	die_handler = handler;
+	return p;
+}
+
+const char *basicast_parse_error(const basicast_program *p) {
+	return p->error;
+}
+
+bool basicast_load_program(basicast *b, const basicast_program *p) {
+	if (p->error[0]) {
+		strcpy(b->error, p->error);
+		return false;
+	}
+
+	entry en;
+	enter(b, &en, __builtin_frame_address(0));
+	if (setjmp(en.jmp)) return leave(b, &en, false);
+
+	for (int i = 0; i < p->len; ++i)
+		load_declaration(p->decls[i], b->e);
+	analyze_purity(b->e); // again, as what's just been loaded can make what's already there impure
+	return leave(b, &en, true);
+}
+
+bool basicast_load(basicast *b, const char *source) {
+	basicast_program *p = basicast_parse(source);
+	bool ok = basicast_load_program(b, p);
+	free(p->decls); // but not the AST, the functions it's made are still running it
+	free(p);
+	return ok;
+}
+
+bool basicast_call(basicast *b, const char *name, int argc, const value *argv, value *result) {
+	entry en;
+	enter(b, &en, __builtin_frame_address(0));
+	if (setjmp(en.jmp)) return leave(b, &en, false);
+
+	value f = lookup_var(b->e, name);
+	if (f == VUNDEF || classify(f) != V_FUNC) die("there's no function %s", name);
+
+	value args[argc + 1]; // here, below the stack base, rather than wherever the caller has them
+	memcpy(args, argv, argc * sizeof(value));
+	*result = call_value(f, argc, args, b->e);
+	return leave(b, &en, true);
+}
+
+value basicast_string(basicast *b, const char *s) {
+	size_t len = strlen(s);
+	if (len <= SHORT_STR_MAX) return short_str(s, len); // short strings have to be short ones, see `short_str`
+
+	if (b->nstrings == b->strings_cap)
+		b->strings = realloc(b->strings, (b->strings_cap = b->strings_cap ? 2 * b->strings_cap : 8) * sizeof(char *));
+	return str2value(b->strings[b->nstrings++] = strdup(s));
+}
+
+const char *basicast_error(const basicast *b) {
+	return b->error;
+}
+
+void basicast_free(basicast *b) {
+	env *e = b->e;
+	for (int i = 0; i < e->globals.len; ++i) {
+		value v = e->globals.entries[i].v;
+		if (classify(v) != V_FUNC) continue;
+		if (value2func(v)->memo) free_memo(value2func(v)->memo);
+		if (value2func(v)->closures) free_closures(value2func(v)->closures);
+#ifdef BASICAST_JIT
+		jit_free(value2func(v));
+#endif
+	}
+	free(e->globals.entries);
+	for (int i = 0; i < e->nframes; ++i)
+		free(e->stackframes[i].entries);
+	free(e->stackframes);
+	free(e);
+
+	gc_free_heap(b->heap);
+	for (int i = 0; i < b->nstrings; ++i)
+		free(b->strings[i]);
+	free(b->strings);
+	free(b);
+}
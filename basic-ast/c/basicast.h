@@ -0,0 +1,90 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Running programs from inside another one: link with libbasicast (`make lib`).
+ *
+ *	basicast *b = basicast_new();
+ *	value v;
+ *	if (!basicast_load(b, "function double(x) { return x + x; }")
+ *	    || !basicast_call(b, "double", 1, (value[]) { num2value(21) }, &v))
+ *		fprintf(stderr, "%s\n", basicast_error(b));
+ *
+ * Each context has its own globals and its own heap, and only one context can
+ * be running at a time on a thread. Nothing exits: an error returns false from whatever
+ * hit it, with the message in `basicast_error`, and the context can go on
+ * being used.
+ *
+ * Values handed back live in the context's heap, which the next load or call
+ * is free to collect and move, so a result is only good until then: copy out
+ * what's needed first, or pass it straight back in as an argument. Ints,
+ * booleans, null and short strings are plain values and never go stale, and
+ * `basicast_string` makes strings that last as long as the context.
+ *
+ * This header's all an embedder needs: the rest of the interpreter's headers
+ * (`value.h` and the like) are its own, and take this one's `value` from here.
+ *
+ * To run the same program on many threads, parse it once and load it into a
+ * context per thread: the parsed program's never changed, so any number of
+ * contexts can load and run it at once. A context belongs to the thread that
+ * made it, and is only ever used (and freed) there. A program lives as long
+ * as the process, since the functions loaded from it go on using it.
+ */
+typedef struct basicast basicast;
+typedef struct basicast_program basicast_program;
+
+// a tagged word, see `value.h`: ints are shifted up 3 bits, strings are a
+// pointer, or up to 7 chars packed into the value itself.
+typedef long long value;
+#define VFALSE 0
+#define VNULL 1
+#define VTRUE 2
+
+enum value_kind { V_INT, V_STR, V_BOOL, V_NULL, V_ARY, V_FUNC, V_MAP };
+__attribute__((noreturn)) void basicast_bad_value(value v);
+static inline enum value_kind classify(value v) {
+	if (v == VNULL) return V_NULL;
+	if (v == VTRUE || v==VFALSE) return V_BOOL;
+	if ((v & 7) == 4) return V_INT;
+	if ((v & 7) == 0) return V_STR;
+	if ((v & 7) == 2) return V_ARY;
+	if ((v & 7) == 1) return V_FUNC;
+	if ((v & 7) == 6) return V_STR;
+	if ((v & 7) == 5) return V_MAP;
+	basicast_bad_value(v);
+}
+
+static inline value num2value(long long n) {
+	return (n << 3) | 4;
+}
+
+static inline long long value2num(value v) {
+	return (long long) v >> 3;
+}
+
+// a string's characters, wherever they are. short ones get unpacked into `buf`.
+static inline const char *str_chars(value v, char buf[8]) {
+	if ((v & 7) != 6) return (const char *) v;
+	__builtin_memcpy(buf, (char *) &v + 1, 7);
+	buf[v >> 3 & 7] = '\0';
+	return buf;
+}
+
+basicast *basicast_new(void);
+bool basicast_load(basicast *b, const char *source); // declarations, added to what's loaded already
+basicast_program *basicast_parse(const char *source);
+const char *basicast_parse_error(const basicast_program *p); // why it didn't parse, or ""
+bool basicast_load_program(basicast *b, const basicast_program *p); // like `basicast_load`
+bool basicast_call(basicast *b, const char *name, int argc, const value *argv, value *result);
+value basicast_string(basicast *b, const char *s); // copied, and owned by the context
+const char *basicast_error(const basicast *b); // what went wrong last, or ""
+void basicast_free(basicast *b);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,501 @@
+#include "closure.h"
+#include "run.h"
+#include "shared.h"
+#include <stdlib.h>
+
+/*
+ * Closure-compiled engine. Each expression and statement is turned into a
+ * small struct holding its already-resolved operands plus a pointer to a
+ * function specialized for exactly that node: a `+` gets `c_add`, a call to a
+ * builtin gets `c_builtin` with the builtin looked up once, parens vanish, etc.
+ * Running a function is then just calling through those pointers, with no
+ * switching on `kind` and no re-reading the AST.
+ *
+ * Variables are resolved as they're compiled too: a global to its index in
+ * `e->globals`, anything else to a slot in the function's frame. The frame's
+ * laid out to match on every call (see `reserve_locals`): the args, bound as
+ * usual, then every other local, undefined until it's assigned. A global
+ * declared later could take over one of those names, so the function's
+ * compiled again if there are more globals than there were.
+ *
+ * Anything that isn't on a fast path goes through the same runtime helpers the
+ * tree walker uses (`run_binop`, `run_builtin`, `call_value`...), so both
+ * engines behave identically.
+ */
+
+typedef struct closure {
+	value (*fn)(struct closure *c, env *e);
+
+	struct closure *lhs, *index, *rhs, **args;
+	int amnt, builtin;
+	token_kind op;
+	bool scratch, global;
+	const char *name; // for errors, it's `slot` that's used to find it
+	int slot;
+	value value; // a literal, or how much an AST_INCR adds (already shifted)
+} closure;
+
+typedef struct closure_stmt {
+	int (*fn)(struct closure_stmt *s, value *ret, env *e);
+
+	closure *expr;
+	struct closure_block *body, *else_body;
+} closure_stmt;
+
+struct closure_block {
+	int amnt;
+	closure_stmt *stmts;
+};
+
+struct closure_function {
+	struct closure_block *body;
+	const char **locals; // the frame's layout
+	int nlocals, nglobals; // and how many globals it was resolved against
+};
+
+// what's been resolved so far, while a function's being compiled.
+typedef struct {
+	env *e;
+	const char **locals;
+	int nlocals, cap;
+} scope;
+
+#define CALL(c) ((c)->fn((c), e))
+
+static value c_literal(closure *c, env *e) {
+	return c->value;
+}
+
+static value *var_ref(closure *c, env *e) {
+	return c->global ? &e->globals.entries[c->slot].v : &e->stackframes[e->sp].entries[c->slot].v;
+}
+
+// `assign_owned`, by slot.
+static void set_var(closure *c, value v, env *e) {
+	value *ref = var_ref(c, e);
+	gc_retain(v);
+	gc_release(*ref);
+	*ref = v;
+	if (c->global) gc_global_barrier(c->slot, v);
+}
+
+static value c_var(closure *c, env *e) {
+	value v = *var_ref(c, e);
+	if (v == VUNDEF)
+		die("undefined variable '%s' accessed", c->name);
+	gc_see(v); // see `lookup_var`
+	return v;
+}
+
+static value c_index(closure *c, env *e) {
+	value v = CALL(c->lhs);
+	return index_into(v, CALL(c->index));
+}
+
+static value c_builtin(closure *c, env *e) {
+	value args[c->amnt];
+	for (int i = 0; i < c->amnt; ++i)
+		args[i] = CALL(c->args[i]);
+	return run_builtin(c->builtin, c->amnt, args, e);
+}
+
+static value c_call(closure *c, env *e) {
+	value fn = CALL(c->lhs), args[c->amnt];
+	for (int i = 0; i < c->amnt; ++i)
+		args[i] = CALL(c->args[i]);
+	return call_value(fn, c->amnt, args, e);
+}
+
+static value c_neg(closure *c, env *e) {
+	return run_neg(CALL(c->lhs));
+}
+
+static value c_not(closure *c, env *e) {
+	return run_not(CALL(c->lhs));
+}
+
+static value c_ary(closure *c, env *e) {
+	value eles[c->amnt];
+	for (int i = 0; i < c->amnt; ++i)
+		eles[i] = CALL(c->args[i]);
+	return make_array(c->scratch, c->amnt, eles, e);
+}
+
+static value c_map(closure *c, env *e) {
+	value kvs[c->amnt];
+	for (int i = 0; i < c->amnt; ++i)
+		kvs[i] = CALL(c->args[i]);
+	return new_map(c->amnt, kvs);
+}
+
+static value c_assign(closure *c, env *e) {
+	value v = CALL(c->rhs);
+	gc_see(v); // see `assign_var`
+	set_var(c, v, e);
+	return v;
+}
+
+static value c_idx_assign(closure *c, env *e) {
+	value v = CALL(c->lhs), v2 = CALL(c->index), v3 = CALL(c->rhs);
+	index_assign(v, v2, v3);
+	return v3;
+}
+
+static value c_binop(closure *c, env *e) {
+	value v = CALL(c->lhs);
+	return run_binop(c->op, v, CALL(c->rhs), c->scratch, e);
+}
+
+// binops with an inline path for two ints; tags are kept, so `+` and `-` work on them directly.
+#define INT_BINOP(name, result) \
+	static value name(closure *c, env *e) { \
+		value v = CALL(c->lhs), v2 = CALL(c->rhs); \
+		if (is_number(v) && is_number(v2)) return result; \
+		return run_binop(c->op, v, v2, c->scratch, e); \
+	}
+
+INT_BINOP(c_add, v + v2 - 4)
+INT_BINOP(c_sub, v - v2 + 4)
+INT_BINOP(c_mul, num2value(value2num(v) * value2num(v2)))
+INT_BINOP(c_lth, v < v2 ? VTRUE : VFALSE)
+INT_BINOP(c_gth, v > v2 ? VTRUE : VFALSE)
+INT_BINOP(c_leq, v <= v2 ? VTRUE : VFALSE)
+INT_BINOP(c_geq, v >= v2 ? VTRUE : VFALSE)
+INT_BINOP(c_eql, v == v2 ? VTRUE : VFALSE)
+INT_BINOP(c_neq, v != v2 ? VTRUE : VFALSE)
+
+// the fused forms, see `fuse.c`.
+static value c_incr(closure *c, env *e) {
+	value *ref = var_ref(c, e);
+	if (is_number(*ref)) {
+		++fusion_hits[AST_INCR - AST_INCR];
+		return *ref += c->value;
+	}
+	return c_assign(c, e);
+}
+
+static value c_lth_length(closure *c, env *e) {
+	value v = CALL(c->lhs), v2 = CALL(c->rhs);
+	if (is_number(v) && classify(v2) == V_ARY) {
+		++fusion_hits[AST_LTH_LENGTH - AST_INCR];
+		return value2num(v) < value2ary(v2)->len ? VTRUE : VFALSE;
+	}
+	return run_binop(TK_LTH, v, run_builtin(BUILTIN_LENGTH, 1, &v2, e), false, e);
+}
+
+static value c_append(closure *c, env *e) {
+	value v = CALL(c->lhs), v2;
+	if (classify(v) == V_ARY) {
+		++fusion_hits[AST_APPEND - AST_INCR];
+		v2 = num2value(value2ary(v)->len);
+	} else {
+		v2 = run_builtin(BUILTIN_LENGTH, 1, &v, e);
+	}
+
+	value v3 = CALL(c->rhs);
+	index_assign(v, v2, v3);
+	return v3;
+}
+
+// `run_extend`, by slot.
+static value c_extend(closure *c, env *e) {
+	value v = *var_ref(c, e), rhs, grown;
+	if (v == VUNDEF) return c_assign(c, e);
+
+	rhs = CALL(c->lhs);
+	if (*var_ref(c, e) == v && gc_unique(v) && extend_in_place(v, rhs, &grown)) {
+		++fusion_hits[AST_EXTEND - AST_INCR];
+		if (grown != v) set_var(c, grown, e);
+		return grown;
+	}
+
+	// the result is thrown away, so the new value isn't seen by anyone either.
+	set_var(c, v = run_binop(TK_ADD, v, rhs, false, e), e);
+	return v;
+}
+
+static closure *new_closure(value (*fn)(closure *, env *)) {
+	closure *c = calloc(1, sizeof(closure));
+	c->fn = fn;
+	return c;
+}
+
+// where `name` lives, the same place `lookup_ref` and `assign_var` would find
+// it: globals come first, as assigning to one never makes a local.
+static void resolve(closure *c, const char *name, scope *s) {
+	c->name = name;
+	for (int i = 0; i < s->e->globals.len; ++i)
+		if (!strcmp(s->e->globals.entries[i].name, name)) {
+			c->global = true;
+			c->slot = i;
+			return;
+		}
+
+	for (c->slot = 0; c->slot < s->nlocals; ++c->slot)
+		if (!strcmp(s->locals[c->slot], name))
+			return;
+	if (s->nlocals == s->cap)
+		s->locals = realloc(s->locals, (s->cap = s->cap ? 2 * s->cap : 8) * sizeof(const char *));
+	s->locals[s->nlocals++] = name;
+}
+
+static closure *compile_expression(ast_expression *expr, scope *s);
+static closure *compile_primary(ast_primary *prim, scope *s) {
+	closure *c;
+
+	switch (prim->kind) {
+	case AST_PAREN:
+		return compile_expression(prim->expr, s);
+
+	case AST_INDEX:
+		c = new_closure(c_index);
+		c->lhs = compile_primary(prim->prim, s);
+		c->index = compile_expression(prim->expr, s);
+		return c;
+
+	case AST_FNCALL:;
+		int builtin = prim->prim->kind == AST_VAR ? builtin_kind(prim->prim->ident) : 0;
+		c = new_closure(builtin ? c_builtin : c_call);
+		c->builtin = builtin;
+		if (!builtin) c->lhs = compile_primary(prim->prim, s);
+		goto args;
+
+	case AST_NEG:
+	case AST_NOT:
+		c = new_closure(prim->kind == AST_NEG ? c_neg : c_not);
+		c->lhs = compile_primary(prim->prim, s);
+		return c;
+
+	case AST_ARY:
+	case AST_MAP:
+		c = new_closure(prim->kind == AST_ARY ? c_ary : c_map);
+		c->scratch = prim->scratch;
+	args:
+		c->amnt = prim->amnt;
+		c->args = malloc(prim->amnt * sizeof(closure *));
+		for (int i = 0; i < prim->amnt; ++i)
+			c->args[i] = compile_expression(prim->args[i], s);
+		return c;
+
+	case AST_VAR:
+		c = new_closure(c_var);
+		resolve(c, prim->ident, s);
+		return c;
+
+	case AST_LITERAL:
+		c = new_closure(c_literal);
+		c->value = prim->value;
+		return c;
+	}
+
+	die("unknown primary kind %d", prim->kind);
+}
+
+static value (*binop_fn(token_kind op))(closure *, env *) {
+	switch (op) {
+	case TK_ADD: return c_add;
+	case TK_SUB: return c_sub;
+	case TK_MUL: return c_mul;
+	case TK_LTH: return c_lth;
+	case TK_GTH: return c_gth;
+	case TK_LEQ: return c_leq;
+	case TK_GEQ: return c_geq;
+	case TK_EQL: return c_eql;
+	case TK_NEQ: return c_neq;
+	default: return c_binop;
+	}
+}
+
+static closure *compile_expression(ast_expression *expr, scope *s) {
+	closure *c;
+
+	switch (expr->kind) {
+	case AST_ASSIGN:
+		c = new_closure(c_assign);
+		resolve(c, expr->name, s);
+		c->rhs = compile_expression(expr->rhs, s);
+		return c;
+
+	case AST_EXTEND:
+		c = new_closure(c_extend);
+		resolve(c, expr->name, s);
+		c->lhs = compile_expression(expr->rhs->rhs, s);
+		c->rhs = compile_expression(expr->rhs, s);
+		return c;
+
+	case AST_INCR:
+		c = new_closure(c_incr);
+		resolve(c, expr->name, s);
+		c->rhs = compile_expression(expr->rhs, s);
+		c->value = expr->rhs->rhs->prim->value - 4;
+		if (expr->rhs->binop == TK_SUB) c->value = -c->value;
+		return c;
+
+	case AST_IDX_ASSIGN:
+	case AST_APPEND:
+		c = new_closure(expr->kind == AST_APPEND ? c_append : c_idx_assign);
+		c->lhs = compile_primary(expr->prim, s);
+		if (expr->kind == AST_IDX_ASSIGN) c->index = compile_expression(expr->index, s);
+		c->rhs = compile_expression(expr->rhs, s);
+		return c;
+
+	case AST_PRIM:
+		return compile_primary(expr->prim, s);
+
+	case AST_BINOP:
+		c = new_closure(binop_fn(expr->binop));
+		c->op = expr->binop;
+		c->scratch = expr->scratch;
+		c->lhs = compile_primary(expr->prim, s);
+		c->rhs = compile_expression(expr->rhs, s);
+		return c;
+
+	case AST_LTH_LENGTH:
+		c = new_closure(c_lth_length);
+		c->lhs = compile_primary(expr->prim, s);
+		c->rhs = compile_primary(expr->rhs->prim->args[0]->prim, s);
+		return c;
+	}
+
+	die("unknown expression kind %d", expr->kind);
+}
+
+static int run_closures(struct closure_block *block, value *ret, env *e);
+
+// anything a statement put in the scratch region is dead once it's done.
+static value run_full_closure(closure *c, env *e) {
+	size_t scratch_len = e->scratch_len;
+	value v = CALL(c);
+	e->scratch_len = scratch_len;
+	return v;
+}
+
+static int s_return(closure_stmt *s, value *ret, env *e) {
+	*ret = s->expr ? run_full_closure(s->expr, e) : VNULL;
+	return RETURN_REQUESTED;
+}
+
+static int s_if(closure_stmt *s, value *ret, env *e) {
+	if (value2bool(run_full_closure(s->expr, e)))
+		return run_closures(s->body, ret, e);
+	return s->else_body ? run_closures(s->else_body, ret, e) : NOTHING;
+}
+
+static int s_while(closure_stmt *s, value *ret, env *e) {
+	int retkind;
+
+	while (value2bool(run_full_closure(s->expr, e))) {
+		if ((retkind = run_closures(s->body, ret, e)) == BREAK_REQUESTED) break;
+		else if (retkind == RETURN_REQUESTED) return RETURN_REQUESTED;
+		gc_safepoint();
+#ifdef BASICAST_JIT
+		if (e->heat) ++*e->heat;
+#endif
+	}
+
+	return NOTHING;
+}
+
+static int s_break(closure_stmt *s, value *ret, env *e) {
+	return BREAK_REQUESTED;
+}
+
+static int s_continue(closure_stmt *s, value *ret, env *e) {
+	return CONTINUE_REQUESTED;
+}
+
+static int s_expr(closure_stmt *s, value *ret, env *e) {
+	run_full_closure(s->expr, e);
+	return NOTHING;
+}
+
+static struct closure_block *compile_block(ast_block *block, scope *sc) {
+	struct closure_block *b = malloc(sizeof(struct closure_block));
+	b->amnt = block->amnt;
+	b->stmts = calloc(block->amnt, sizeof(closure_stmt));
+
+	for (int i = 0; i < block->amnt; ++i) {
+		ast_statement *s = block->stmts[i];
+		closure_stmt *cs = &b->stmts[i];
+
+		switch (s->kind) {
+		case AST_RETURN: cs->fn = s_return; break;
+		case AST_IF: cs->fn = s_if; break;
+		case AST_WHILE: cs->fn = s_while; break;
+		case AST_BREAK: cs->fn = s_break; break;
+		case AST_CONTINUE: cs->fn = s_continue; break;
+		case AST_EXPR: cs->fn = s_expr; break;
+		}
+
+		if (s->kind != AST_BREAK && s->kind != AST_CONTINUE && s->expr)
+			cs->expr = compile_expression(s->expr, sc);
+		if (s->kind == AST_IF || s->kind == AST_WHILE) cs->body = compile_block(s->body, sc);
+		if (s->kind == AST_IF && s->else_body) cs->else_body = compile_block(s->else_body, sc);
+	}
+
+	return b;
+}
+
+static struct closure_function *compile_function(function *f, env *e) {
+	scope s = { .e = e };
+	closure arg = { 0 };
+	for (int i = 0; i < f->argc; ++i)
+		resolve(&arg, f->argv[i], &s); // so they're the first slots, as `enter_call` binds them
+
+	struct closure_function *cf = malloc(sizeof(struct closure_function));
+	cf->body = compile_block(f->block, &s);
+	cf->locals = s.locals;
+	cf->nlocals = s.nlocals;
+	cf->nglobals = e->globals.len;
+	return cf;
+}
+
+static void free_closure(closure *c) {
+	if (!c) return;
+	free_closure(c->lhs);
+	free_closure(c->index);
+	free_closure(c->rhs);
+	for (int i = 0; c->args && i < c->amnt; ++i)
+		free_closure(c->args[i]);
+	free(c->args);
+	free(c);
+}
+
+static void free_block(struct closure_block *b) {
+	if (!b) return;
+	for (int i = 0; i < b->amnt; ++i) {
+		free_closure(b->stmts[i].expr);
+		free_block(b->stmts[i].body);
+		free_block(b->stmts[i].else_body);
+	}
+	free(b->stmts);
+	free(b);
+}
+
+void free_closures(struct closure_function *cf) {
+	free_block(cf->body);
+	free(cf->locals);
+	free(cf);
+}
+
+// a call, once `enter_call` has made the frame and bound the args.
+int run_function_closures(function *f, value *ret, env *e) {
+	if (f->closures && f->closures->nglobals != e->globals.len) {
+		free_closures(f->closures);
+		f->closures = 0;
+	}
+	if (!f->closures) f->closures = compile_function(f, e);
+
+	reserve_locals(e, f->closures->nlocals, f->closures->locals);
+	return run_closures(f->closures->body, ret, e);
+}
+
+static int run_closures(struct closure_block *block, value *ret, env *e) {
+	int retkind;
+
+	for (closure_stmt *s = block->stmts, *end = s + block->amnt; s != end; ++s)
+		if ((retkind = s->fn(s, ret, e)))
+			return retkind;
+
+	return NOTHING;
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include "value.h"
+
+// `--engine=closure`: function bodies get compiled to closures on their first
+// call, and are run with `run_function_closures` instead of `run_block`.
+struct closure_function;
+struct env;
+int run_function_closures(function *f, value *ret, struct env *e);
+void free_closures(struct closure_function *cf);
@@ -0,0 +1,89 @@
+#include "concat.h"
+#include "run.h"
+#include <stdlib.h>
+
+/*
+ * Building a string out of many parts at once: `join(a, sep)`, `concat(...)`,
+ * and chains of `+` with a string literal in them, which `fuse.c` turns into
+ * calls to the "+" builtin.
+ *
+ * Every part is measured first (ints by counting digits), then the string's
+ * allocated once, at its exact size, and each part is copied (or formatted)
+ * straight into place. Parts get converted like `+` converts the right side of
+ * a string: ints in decimal, and `true`, `false` and `null` as words.
+ */
+
+static size_t int_length(long long n) {
+	unsigned long long u = n < 0 ? -(unsigned long long) n : n;
+	size_t len = 1 + (n < 0);
+	for (; u >= 100; u /= 100)
+		len += 2;
+	return len + (u >= 10);
+}
+
+static size_t part_length(value v) {
+	switch (classify(v)) {
+	case V_STR: return is_short_str(v) ? short_str_len(v) : strlen(value2str(v));
+	case V_INT: return int_length(value2num(v));
+	case V_BOOL: return v == VTRUE ? 4 : 5;
+	case V_NULL: return 4;
+	default: die("todo, convert other types to strings, not %d", classify(v));
+	}
+}
+
+// writes v's `len` characters to `to` (maybe a '\0' after them too), returns where they end.
+static char *put_part(char *to, value v, size_t len) {
+	char buf[8];
+	switch (classify(v)) {
+	case V_INT: format_int(to, value2num(v)); break;
+	case V_STR: memcpy(to, str_chars(v, buf), len); break;
+	case V_BOOL: memcpy(to, v == VTRUE ? "true" : "false", len); break;
+	default: memcpy(to, "null", len); break;
+	}
+	return to + len;
+}
+
+// `*parts` is read again after allocating, it might be an array's buffer, which can move.
+static value build(value *const *parts, int n, value sep) {
+	size_t *lens = malloc(n * sizeof(size_t)), total = 0, seplen = sep == VUNDEF ? 0 : part_length(sep);
+	for (int i = 0; i < n; ++i)
+		total += lens[i] = part_length((*parts)[i]);
+	if (n) total += seplen * (n - 1);
+
+	char small[SHORT_STR_MAX + 1], *s = total <= SHORT_STR_MAX ? small : gc_alloc(GC_STR, total + 1), *p = s;
+	for (int i = 0; i < n; ++i) {
+		if (i && seplen) p = put_part(p, sep, seplen);
+		p = put_part(p, (*parts)[i], lens[i]);
+	}
+	*p = '\0';
+
+	free(lens);
+	return s == small ? short_str(small, total) : str2value(s);
+}
+
+value concat_values(int n, value *parts) {
+	return build(&parts, n, VUNDEF);
+}
+
+value join_array(value av, value sep) {
+	if (classify(av) != V_ARY || classify(sep) != V_STR) die("usage: join(array, string)");
+	return build(&value2ary(av)->eles, value2ary(av)->len, sep);
+}
+
+// `ops[0] + (ops[1] + (... + ops[n - 1]))`. it's a string iff everything but
+// the last is, and then it's all of them concatenated; otherwise it's left to
+// `run_binop`, from the first non-string on, to give the same result (or error).
+value add_chain(int n, value *ops, env *e) {
+	int k = 0;
+	while (k < n - 1 && classify(ops[k]) == V_STR) ++k;
+	if (k == n - 1) return concat_values(n, ops);
+
+	value parts[k + 1];
+	parts[k] = ops[n - 1];
+	for (int i = n - 2; i >= k; --i)
+		parts[k] = run_binop(TK_ADD, ops[i], parts[k], false, e);
+	if (!k) return parts[0];
+
+	memcpy(parts, ops, k * sizeof(value));
+	return concat_values(k + 1, parts);
+}
@@ -0,0 +1,8 @@
+#pragma once
+#include "value.h"
+
+// strings built from many parts, with one allocation, see `concat.c`.
+struct env;
+value concat_values(int n, value *parts);
+value join_array(value a, value sep);
+value add_chain(int n, value *ops, struct env *e);
@@ -0,0 +1,22 @@
+#include "shared.h"
+#include <stdarg.h>
+#include <string.h>
+
+__thread jmp_buf *die_handler;
+__thread char die_message[1024];
+
+void die_with(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	if (!die_handler) {
+		vfprintf(stderr, fmt, ap);
+		exit(1);
+	}
+
+	vsnprintf(die_message, sizeof(die_message), fmt, ap);
+	va_end(ap);
+	size_t len = strlen(die_message);
+	while (len && die_message[len - 1] == '\n')
+		die_message[--len] = '\0';
+	longjmp(*die_handler, 1);
+}
@@ -0,0 +1,476 @@
+#include "run.h"
+#include "memo.h"
+#include "shared.h"
+#include <string.h>
+#include <stdarg.h>
+
+/*
+ * `--emit-c`: translates a whole program into a standalone C file, which is then
+ * compiled against `runtime.a` (see the Makefile):
+ *
+ *     ./main --emit-c "$(cat prog.txt)" > prog.c
+ *     cc -O2 -I. prog.c runtime.a -o prog
+ *
+ * Every function becomes a native function (the same `value f(value *, env *)`
+ * shape the JIT uses), locals become C variables, and each subexpression gets its
+ * own temporary so evaluation order matches the interpreter exactly. Integer ops
+ * get inline fast paths; everything else goes through `run_binop`, `index_into`,
+ * `index_assign`, `call_value` and `run_builtin`, so semantics are the same.
+ *
+ * Purity's worked out here, on the AST (see `purity.c`), and the pure functions
+ * are given a memo at startup, so they're memoized like they'd be interpreted.
+ */
+
+typedef struct {
+	FILE *out;
+	int indent, ntemps, nloops;
+
+	ast_declaration **decls;
+	int ndecls;
+
+	char **locals;
+	int nlocals, nargs;
+} emitter;
+
+// the generated code names the runtime's enums rather than baking in their values.
+#define NAME(k) [k] = #k
+static const char *builtin_names[] = {
+	NAME(BUILTIN_PRINT), NAME(BUILTIN_PUSH), NAME(BUILTIN_POP), NAME(BUILTIN_LENGTH),
+	NAME(BUILTIN_MEMOIZE), NAME(BUILTIN_SLICE), NAME(BUILTIN_SUM), NAME(BUILTIN_MIN),
+	NAME(BUILTIN_MAX), NAME(BUILTIN_FILL), NAME(BUILTIN_DOT), NAME(BUILTIN_MAP_ADD),
+	NAME(BUILTIN_MAP_MUL), NAME(BUILTIN_FIND), NAME(BUILTIN_KEYS), NAME(BUILTIN_HAS),
+	NAME(BUILTIN_DELETE), NAME(BUILTIN_SORT), NAME(BUILTIN_JOIN), NAME(BUILTIN_CONCAT),
+	NAME(BUILTIN_ADD_CHAIN), NAME(BUILTIN_READ_FILE), NAME(BUILTIN_LINES),
+	NAME(BUILTIN_NEXT_LINE), NAME(BUILTIN_WRITE_FILE),
+};
+static const char *binop_names[256] = {
+	NAME(TK_ADD), NAME(TK_SUB), NAME(TK_MUL), NAME(TK_DIV), NAME(TK_MOD),
+	NAME(TK_LTH), NAME(TK_GTH), NAME(TK_LEQ), NAME(TK_GEQ), NAME(TK_EQL), NAME(TK_NEQ),
+};
+#undef NAME
+
+static void indent(emitter *c) {
+	for (int i = 0; i < c->indent; ++i) fputc('\t', c->out);
+}
+
+static void line(emitter *c, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	indent(c);
+	vfprintf(c->out, fmt, ap);
+	fputc('\n', c->out);
+	va_end(ap);
+}
+
+static bool is_global(emitter *c, const char *name) {
+	for (int i = 0; i < c->ndecls; ++i)
+		if (!strcmp(c->decls[i]->name, name))
+			return true;
+	return false;
+}
+
+static int local_index(emitter *c, const char *name) {
+	for (int i = 0; i < c->nlocals; ++i)
+		if (!strcmp(c->locals[i], name))
+			return i;
+	return -1;
+}
+
+static void add_local(emitter *c, char *name) {
+	if (is_global(c, name) || local_index(c, name) >= 0)
+		return;
+	c->locals = realloc(c->locals, (c->nlocals + 1) * sizeof(char *));
+	c->locals[c->nlocals++] = name;
+}
+
+static void collect_expression(emitter *c, ast_expression *expr);
+static void collect_primary(emitter *c, ast_primary *prim) {
+	switch (prim->kind) {
+	case AST_PAREN:
+		collect_expression(c, prim->expr);
+		break;
+	case AST_INDEX:
+		collect_expression(c, prim->expr);
+		// fallthru
+	case AST_NEG:
+	case AST_NOT:
+		collect_primary(c, prim->prim);
+		break;
+	case AST_FNCALL:
+		collect_primary(c, prim->prim);
+		// fallthru
+	case AST_ARY:
+	case AST_MAP:
+		for (int i = 0; i < prim->amnt; ++i)
+			collect_expression(c, prim->args[i]);
+		break;
+	default:
+		break;
+	}
+}
+
+static void collect_expression(emitter *c, ast_expression *expr) {
+	switch (expr->kind) {
+	case AST_ASSIGN:
+	case AST_INCR:
+	case AST_EXTEND:
+		add_local(c, expr->name);
+		break;
+	case AST_IDX_ASSIGN:
+	case AST_APPEND:
+		collect_expression(c, expr->index);
+		// fallthru
+	case AST_BINOP:
+	case AST_LTH_LENGTH:
+		collect_primary(c, expr->prim);
+		break;
+	case AST_PRIM:
+		collect_primary(c, expr->prim);
+		return;
+	}
+	collect_expression(c, expr->rhs);
+}
+
+static void collect_locals(emitter *c, ast_block *block) {
+	for (int i = 0; i < block->amnt; ++i) {
+		ast_statement *s = block->stmts[i];
+		switch (s->kind) {
+		case AST_IF:
+			if (s->else_body) collect_locals(c, s->else_body);
+			// fallthru
+		case AST_WHILE:
+			collect_locals(c, s->body);
+			// fallthru
+		case AST_EXPR:
+		case AST_RETURN:
+			if (s->expr) collect_expression(c, s->expr);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+static void emit_string(emitter *c, int temp, const char *str) {
+	indent(c);
+	fprintf(c->out, "static _Alignas(8) char s%d[] = \"", temp);
+	for (; *str; ++str) {
+		if (*str == '"' || *str == '\\') fprintf(c->out, "\\%c", *str);
+		else if (' ' <= *str && *str <= '~') fputc(*str, c->out);
+		else fprintf(c->out, "\\%03o", (unsigned char) *str);
+	}
+	fprintf(c->out, "\";\n");
+}
+
+// evaluates `len` expressions into an array temporary, returns its number (or -1 if `len` is 0).
+static int emit_expression(emitter *c, ast_expression *expr);
+static int emit_args(emitter *c, int len, ast_expression **args) {
+	if (!len) return -1;
+
+	int temps[len];
+	for (int i = 0; i < len; ++i)
+		temps[i] = emit_expression(c, args[i]);
+
+	int t = c->ntemps++;
+	indent(c);
+	fprintf(c->out, "value t%d[] = { ", t);
+	for (int i = 0; i < len; ++i)
+		fprintf(c->out, "t%d, ", temps[i]);
+	fprintf(c->out, "};\n");
+	return t;
+}
+
+static int emit_primary(emitter *c, ast_primary *prim) {
+	int t, t1, t2, idx;
+
+	switch (prim->kind) {
+	case AST_PAREN:
+		return emit_expression(c, prim->expr);
+
+	case AST_INDEX:
+		t1 = emit_primary(c, prim->prim);
+		t2 = emit_expression(c, prim->expr);
+		line(c, "value t%d = index_into(t%d, t%d);", t = c->ntemps++, t1, t2);
+		return t;
+
+	case AST_FNCALL:;
+		int builtin = prim->prim->kind == AST_VAR ? builtin_kind(prim->prim->ident) : 0;
+		if (!builtin) t1 = emit_primary(c, prim->prim);
+		t2 = emit_args(c, prim->amnt, prim->args);
+		char args[32] = "0";
+		if (t2 >= 0) sprintf(args, "t%d", t2);
+
+		if (builtin)
+			line(c, "value t%d = run_builtin(%s, %d, %s, e);", t = c->ntemps++, builtin_names[builtin], prim->amnt, args);
+		else
+			line(c, "value t%d = call_value(t%d, %d, %s, e);", t = c->ntemps++, t1, prim->amnt, args);
+		return t;
+
+	case AST_NEG:
+		t1 = emit_primary(c, prim->prim);
+		line(c, "value t%d = is_number(t%d) ? 8 - t%d : run_neg(t%d);", t = c->ntemps++, t1, t1, t1);
+		return t;
+
+	case AST_NOT:
+		t1 = emit_primary(c, prim->prim);
+		line(c, "value t%d = run_not(t%d);", t = c->ntemps++, t1);
+		return t;
+
+	case AST_ARY:
+		t1 = emit_args(c, prim->amnt, prim->args);
+		if (t1 < 0) line(c, "value t%d = new_array(0, 0);", t = c->ntemps++);
+		else line(c, "value t%d = new_array(%d, t%d);", t = c->ntemps++, prim->amnt, t1);
+		return t;
+
+	case AST_MAP:
+		t1 = emit_args(c, prim->amnt, prim->args);
+		if (t1 < 0) line(c, "value t%d = new_map(0, 0);", t = c->ntemps++);
+		else line(c, "value t%d = new_map(%d, t%d);", t = c->ntemps++, prim->amnt, t1);
+		return t;
+
+	case AST_VAR:
+		t = c->ntemps++;
+		if ((idx = local_index(c, prim->ident)) < 0) {
+			line(c, "value t%d = lookup_var(e, \"%s\");", t, prim->ident);
+		} else {
+			line(c, "value t%d = l_%s;", t, prim->ident);
+			if (idx < c->nargs) return t; // args are always defined.
+		}
+		line(c, "if (t%d == VUNDEF) die(\"undefined variable '%%s' accessed\", \"%s\");", t, prim->ident);
+		return t;
+
+	case AST_LITERAL:
+		t = c->ntemps++;
+		switch (classify(prim->value)) {
+		case V_INT:
+			line(c, "value t%d = num2value(%lldLL);", t, value2num(prim->value));
+			break;
+		case V_STR:
+			if (!is_short_str(prim->value)) {
+				emit_string(c, t, value2str(prim->value));
+				line(c, "value t%d = str2value(s%d);", t, t);
+				break;
+			}
+			// fallthru, short strings are constants like any other
+		default:
+			line(c, "value t%d = %lld;", t, prim->value);
+		}
+		return t;
+	}
+
+	die("unknown primary kind %d", prim->kind);
+}
+
+static int emit_binop(emitter *c, token_kind op, int t1, int t2) {
+	int t = c->ntemps++;
+	const char *fast = 0;
+
+	switch (op) {
+	case TK_ADD: fast = "t%1$d + t%2$d - 4"; break;
+	case TK_SUB: fast = "t%1$d - t%2$d + 4"; break;
+	case TK_MUL: fast = "(t%1$d >> 3) * (t%2$d - 4) + 4"; break;
+	case TK_LTH: fast = "t%1$d < t%2$d ? VTRUE : VFALSE"; break;
+	case TK_GTH: fast = "t%1$d > t%2$d ? VTRUE : VFALSE"; break;
+	case TK_LEQ: fast = "t%1$d <= t%2$d ? VTRUE : VFALSE"; break;
+	case TK_GEQ: fast = "t%1$d >= t%2$d ? VTRUE : VFALSE"; break;
+	case TK_EQL: fast = "t%1$d == t%2$d ? VTRUE : VFALSE"; break;
+	case TK_NEQ: fast = "t%1$d != t%2$d ? VTRUE : VFALSE"; break;
+	default: break;
+	}
+
+	indent(c);
+	fprintf(c->out, "value t%d = ", t);
+	if (fast) {
+		fprintf(c->out, "is_number(t%d) && is_number(t%d) ? ", t1, t2);
+		fprintf(c->out, fast, t1, t2);
+		fprintf(c->out, " : ");
+	}
+	if (op < 0 || op >= 256 || !binop_names[op]) die("unknown binary operator %d", op);
+	fprintf(c->out, "run_binop(%s, t%d, t%d, false, e);\n", binop_names[op], t1, t2);
+	return t;
+}
+
+static int emit_expression(emitter *c, ast_expression *expr) {
+	int t, t1, t2;
+
+	switch (expr->kind) {
+	case AST_ASSIGN:
+	case AST_INCR:
+	case AST_EXTEND:
+		t = emit_expression(c, expr->rhs);
+		if (local_index(c, expr->name) >= 0)
+			line(c, "l_%s = t%d;", expr->name, t);
+		else
+			line(c, "assign_var(e, \"%s\", t%d);", expr->name, t);
+		return t;
+
+	case AST_IDX_ASSIGN:
+	case AST_APPEND:
+		t1 = emit_primary(c, expr->prim);
+		t2 = emit_expression(c, expr->index);
+		t = emit_expression(c, expr->rhs);
+		line(c, "index_assign(t%d, t%d, t%d);", t1, t2, t);
+		return t;
+
+	case AST_BINOP:
+	case AST_LTH_LENGTH:
+		t1 = emit_primary(c, expr->prim);
+		t2 = emit_expression(c, expr->rhs);
+		return emit_binop(c, expr->binop, t1, t2);
+
+	case AST_PRIM:
+		return emit_primary(c, expr->prim);
+	}
+
+	die("unknown expression kind %d", expr->kind);
+}
+
+static void emit_block(emitter *c, ast_block *block) {
+	for (int i = 0; i < block->amnt; ++i) {
+		ast_statement *s = block->stmts[i];
+		int t;
+
+		switch (s->kind) {
+		case AST_RETURN:
+			if (s->expr) line(c, "return t%d;", emit_expression(c, s->expr));
+			else line(c, "return VNULL;");
+			break;
+
+		case AST_IF:
+			t = emit_expression(c, s->expr);
+			line(c, "if (value2bool(t%d)) {", t);
+			++c->indent;
+			emit_block(c, s->body);
+			--c->indent;
+			if (s->else_body) {
+				line(c, "} else {");
+				++c->indent;
+				emit_block(c, s->else_body);
+				--c->indent;
+			}
+			line(c, "}");
+			break;
+
+		case AST_WHILE:
+			line(c, "for (;;) {");
+			++c->indent;
+			line(c, "gc_safepoint();");
+			t = emit_expression(c, s->expr);
+			line(c, "if (!value2bool(t%d)) break;", t);
+			++c->nloops;
+			emit_block(c, s->body);
+			--c->nloops;
+			--c->indent;
+			line(c, "}");
+			break;
+
+		case AST_BREAK:
+		case AST_CONTINUE:
+			// outside of a loop, `run_block` just bails out of the function.
+			if (!c->nloops) line(c, "return VNULL;");
+			else line(c, s->kind == AST_BREAK ? "break;" : "continue;");
+			break;
+
+		case AST_EXPR:
+			emit_expression(c, s->expr);
+			break;
+		}
+	}
+}
+
+static void emit_function(emitter *c, ast_declaration *d) {
+	c->nlocals = c->nargs = c->ntemps = 0;
+
+	line(c, "static value fn_%s(value *argv, env *e) {", d->name);
+	++c->indent;
+
+	// args that are also globals get assigned to the global, just like `call_value` does.
+	for (int i = 0; i < d->argc; ++i)
+		if (is_global(c, d->args[i]))
+			line(c, "assign_var(e, \"%s\", argv[%d]);", d->args[i], i);
+		else
+			add_local(c, d->args[i]);
+
+	c->nargs = c->nlocals;
+	for (int i = 0; i < d->argc; ++i)
+		if (local_index(c, d->args[i]) >= 0)
+			line(c, "value l_%s = argv[%d];", d->args[i], i);
+
+	collect_locals(c, d->block);
+	for (int i = c->nargs; i < c->nlocals; ++i)
+		line(c, "value l_%s = VUNDEF;", c->locals[i]);
+
+	emit_block(c, d->block);
+	line(c, "return VNULL;");
+	--c->indent;
+	line(c, "}");
+	line(c, "");
+}
+
+// which functions `analyze_purity` finds pure, by declaring them all in an env of their own.
+static bool *find_pure(ast_declaration **decls, int ndecls) {
+	env *e = calloc(1, sizeof(env));
+	gc_init(e, __builtin_frame_address(0));
+	for (int i = 0; i < ndecls; ++i)
+		load_declaration(decls[i], e);
+	analyze_purity(e);
+
+	bool *pure = calloc((unsigned) ndecls, sizeof(bool));
+	for (int i = 0; i < ndecls; ++i)
+		if (decls[i]->kind == AST_FUNCTION)
+			pure[i] = value2func(lookup_var(e, decls[i]->name))->pure;
+	return pure; // e's left as it is, the program's about to exit anyway
+}
+
+void emit_c(FILE *out, ast_declaration **decls, int ndecls) {
+	emitter c = { .out = out, .decls = decls, .ndecls = ndecls };
+	bool *pure = find_pure(decls, ndecls);
+
+	line(&c, "// generated by `basic-ast --emit-c`");
+	line(&c, "#include \"run.h\"");
+	line(&c, "#include \"memo.h\"");
+	line(&c, "#include \"shared.h\"");
+	line(&c, "");
+	line(&c, "static env e;");
+	line(&c, "");
+
+	for (int i = 0; i < ndecls; ++i)
+		if (decls[i]->kind == AST_FUNCTION)
+			line(&c, "static value fn_%s(value *argv, env *e);", decls[i]->name);
+	line(&c, "");
+
+	for (int i = 0; i < ndecls; ++i)
+		if (decls[i]->kind == AST_FUNCTION)
+			emit_function(&c, decls[i]);
+
+	line(&c, "int main(void) {");
+	++c.indent;
+	line(&c, "gc_init(&e, __builtin_frame_address(0));");
+	for (int i = 0; i < ndecls; ++i) {
+		if (decls[i]->kind == AST_GLOBAL)
+			line(&c, "declare_global(&e, \"%s\", VNULL);", decls[i]->name);
+		else
+			line(&c, "declare_global(&e, \"%1$s\", new_native_function(\"%1$s\", %2$d, fn_%1$s));",
+				decls[i]->name, decls[i]->argc);
+	}
+	line(&c, "");
+	bool declared = false;
+	for (int i = 0; i < ndecls; ++i) {
+		if (!pure[i]) continue;
+		if (!declared) line(&c, "function *f;");
+		declared = true;
+		line(&c, "f = value2func(lookup_var(&e, \"%s\"));", decls[i]->name);
+		line(&c, "f->pure = true;");
+		line(&c, "f->memo = new_memo(MEMO_CAPACITY);");
+	}
+	line(&c, "");
+	line(&c, "value v;");
+	line(&c, "if ((v = lookup_var(&e, \"main\")) == VUNDEF)");
+	line(&c, "\tdie(\"you must define a `main` function\");");
+	line(&c, "call_value(v, 0, 0, &e);");
+	--c.indent;
+	line(&c, "}");
+
+	free(c.locals);
+	free(pure);
+}
@@ -2,27 +2,50 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include "shared.h"
+#include "gc.h"
+
+int stackframe_limit = STACKFRAME_LIMIT;
 
 value lookup_var(env *e, const char *s) {
+	value *ref = lookup_ref(e, s);
+	if (!ref) return VUNDEF;
+
+	gc_see(*ref); // whoever asked might hold onto it, see `gc.h`
+	return *ref;
+}
+
+// like `lookup_var`, but returns where the variable lives so it can be updated in place.
+value *lookup_ref(env *e, const char *s) {
 	if (e->sp) {
 		map *locals = &e->stackframes[e->sp];
 
 		for (int i = 0; i < locals->len; ++i)
 			if (!strcmp(locals->entries[i].name, s))
-				return locals->entries[i].v;
+				return &locals->entries[i].v;
 	}
 
 	for (int i = 0; i < e->globals.len; ++i)
 		if (!strcmp(e->globals.entries[i].name, s))
-			return e->globals.entries[i].v;
+			return &e->globals.entries[i].v;
 
-	return VUNDEF;
+	return 0;
 }
 
 void assign_var(env *e, const char *s, value v) {
+	gc_see(v); // the assignment's own value might get used by the expression around it
+	assign_owned(e, s, v);
+}
+
+// `assign_var` for a value nothing but the variable can be holding onto.
+void assign_owned(env *e, const char *s, value v) {
+	gc_retain(v);
+
 	for (int i = 0; i < e->globals.len; ++i)
 		if (!strcmp(e->globals.entries[i].name, s)) {
+			gc_release(e->globals.entries[i].v);
 			e->globals.entries[i].v = v;
+			gc_global_barrier(i, v);
 			return;
 		}
 
@@ -30,6 +53,7 @@ void assign_var(env *e, const char *s, value v) {
 
 	for (int i = 0; i < locals->len; ++i)
 		if (!strcmp(locals->entries[i].name, s)) {
+			gc_release(locals->entries[i].v);
 			locals->entries[i].v = v;
 			return;
 		}
@@ -50,3 +74,40 @@ void declare_global(env *e, const char *s, value v) {
 
 	e->globals.entries[e->globals.len++] = (struct entry) { .name = s, .v = v };
 }
+
+void push_frame(env *e) {
+	if (++e->sp >= stackframe_limit)
+		die("stack too deep: more than %d frames", stackframe_limit);
+	if (e->sp < e->nframes)
+		return;
+
+	int n = e->nframes ? e->nframes * 2 : 64;
+	if (n > stackframe_limit) n = stackframe_limit;
+	e->stackframes = realloc(e->stackframes, n * sizeof(map));
+	memset(e->stackframes + e->nframes, 0, (n - e->nframes) * sizeof(map));
+	e->nframes = n;
+}
+
+// lays the current frame out as `names`, with the ones that aren't bound yet
+// undefined until they're assigned. those that are have to come first, in
+// order, as `closure.c` has already worked out where each one is.
+void reserve_locals(env *e, int n, const char **names) {
+	map *locals = &e->stackframes[e->sp];
+	assert(locals->len <= n);
+	if (locals->cap < n)
+		locals->entries = realloc(locals->entries, (locals->cap = n) * sizeof(struct entry));
+	for (int i = locals->len; i < n; ++i)
+		locals->entries[i] = (struct entry) { .name = names[i], .v = VUNDEF };
+	locals->len = n;
+}
+
+void *scratch_alloc(env *e, size_t size) {
+	size = (size + sizeof(value) - 1) / sizeof(value); // keep the low tag bits free.
+
+	if (SCRATCH_SIZE / sizeof(value) - e->scratch_len < size)
+		return 0;
+
+	void *ptr = &e->scratch[e->scratch_len];
+	e->scratch_len += size;
+	return ptr;
+}
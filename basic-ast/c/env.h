@@ -1,20 +1,42 @@
 #pragma once
 #include "value.h"
 
+// default for `stackframe_limit`, which `--max-depth` overrides at runtime.
 #ifndef STACKFRAME_LIMIT
 #define STACKFRAME_LIMIT 10000
 #endif
 
+// size, in bytes, of the scratch region non-escaping temporaries are bump
+// allocated from. when it runs out they go on the heap, through `gc_alloc`.
+#ifndef SCRATCH_SIZE
+#define SCRATCH_SIZE (1 << 20)
+#endif
+
 typedef struct {
 	int cap, len;
 	struct entry { const char *name; value v; } *entries;
 } map;
 
 typedef struct env {
-	int sp;
-	map globals, stackframes[STACKFRAME_LIMIT];
+	int sp, nframes;
+	map globals, *stackframes; // grown on demand by `push_frame`
+
+	size_t scratch_len;
+	value scratch[SCRATCH_SIZE / sizeof(value)];
+
+#ifdef BASICAST_JIT
+	int *heat; // the currently interpreted function's `heat`, bumped on loop back-edges.
+#endif
 } env;
 
+extern int stackframe_limit;
+
 value lookup_var(env *, const char *);
+value *lookup_ref(env *, const char *);
 void assign_var(env *, const char *, value);
+void assign_owned(env *, const char *, value);
 void declare_global(env *, const char *, value);
+void push_frame(env *);
+void reserve_locals(env *, int n, const char **names);
+
+void *scratch_alloc(env *, size_t);
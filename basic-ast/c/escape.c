@@ -0,0 +1,135 @@
+#include "run.h"
+
+/*
+ * Escape analysis: figure out which array literals and `+` results are only
+ * ever consumed by the full expression that built them. Those get allocated in
+ * the env's scratch region, which `run_block` reclaims after every statement.
+ *
+ * A value "escapes" if it can be observed after its full expression is done:
+ * assigned to a variable, stored in an array or map, returned, or passed to a user
+ * function (which could do any of those). Everything else (comparisons,
+ * conditions, the base of an index, `print` and `length` args, operands of `+`
+ * which copies them) just looks at the value and drops it.
+ *
+ * The same walk also answers whether a variable's value can escape, for `-n`
+ * (see `process_records`), in which case nothing gets marked.
+ */
+
+// the variable `var_escapes` is looking for, if it's running.
+static __thread const char *watched;
+static __thread bool watched_escapes;
+
+static void visit_expression(ast_expression *expr, bool escapes);
+static void visit_primary(ast_primary *prim, bool escapes) {
+	switch (prim->kind) {
+	case AST_PAREN:
+		visit_expression(prim->expr, escapes);
+		break;
+
+	case AST_INDEX:
+		visit_primary(prim->prim, false);
+		visit_expression(prim->expr, false);
+		break;
+
+	case AST_FNCALL:;
+		int builtin = prim->prim->kind == AST_VAR ? builtin_kind(prim->prim->ident) : 0;
+		bool keeps_args = builtin != BUILTIN_PRINT && builtin != BUILTIN_LENGTH && builtin != BUILTIN_SUM
+			&& builtin != BUILTIN_MIN && builtin != BUILTIN_MAX && builtin != BUILTIN_DOT && builtin != BUILTIN_FIND
+			&& builtin != BUILTIN_MAP_ADD && builtin != BUILTIN_MAP_MUL && builtin != BUILTIN_KEYS && builtin != BUILTIN_HAS
+			&& builtin != BUILTIN_DELETE && builtin != BUILTIN_JOIN && builtin != BUILTIN_CONCAT && builtin != BUILTIN_READ_FILE
+			&& builtin != BUILTIN_LINES && builtin != BUILTIN_NEXT_LINE && builtin != BUILTIN_WRITE_FILE;
+
+		visit_primary(prim->prim, false);
+		for (int i = 0; i < prim->amnt; ++i)
+			visit_expression(prim->args[i], keeps_args);
+		break;
+
+	case AST_NEG:
+	case AST_NOT:
+		visit_primary(prim->prim, false);
+		break;
+
+	case AST_MAP:
+		for (int i = 0; i < prim->amnt; ++i)
+			visit_expression(prim->args[i], true);
+		break;
+
+	case AST_ARY:
+		if (!watched) prim->scratch = !escapes;
+		for (int i = 0; i < prim->amnt; ++i)
+			visit_expression(prim->args[i], true);
+		break;
+
+	case AST_VAR:
+		if (escapes && watched && !strcmp(prim->ident, watched)) watched_escapes = true;
+		break;
+	case AST_LITERAL:
+		break;
+	}
+}
+
+static void visit_expression(ast_expression *expr, bool escapes) {
+	switch (expr->kind) {
+	case AST_ASSIGN:
+	case AST_INCR:
+	case AST_EXTEND:
+		visit_expression(expr->rhs, true);
+		break;
+
+	case AST_IDX_ASSIGN:
+	case AST_APPEND:
+		// the array being assigned into might need to grow, so it has to be on the heap.
+		visit_primary(expr->prim, true);
+		visit_expression(expr->index, true); // a map keeps it as a key
+		visit_expression(expr->rhs, true);
+		break;
+
+	case AST_BINOP:
+	case AST_LTH_LENGTH:
+		if (!watched) expr->scratch = expr->binop == TK_ADD && !escapes;
+		visit_primary(expr->prim, false);
+		visit_expression(expr->rhs, false);
+		break;
+
+	case AST_PRIM:
+		visit_primary(expr->prim, escapes);
+		break;
+	}
+}
+
+void analyze_escapes(ast_block *block) {
+	for (int i = 0; i < block->amnt; ++i) {
+		ast_statement *s = block->stmts[i];
+
+		switch (s->kind) {
+		case AST_RETURN:
+			if (s->expr) visit_expression(s->expr, true);
+			break;
+
+		case AST_IF:
+			if (s->else_body) analyze_escapes(s->else_body);
+			// fallthru
+		case AST_WHILE:
+			visit_expression(s->expr, false);
+			analyze_escapes(s->body);
+			break;
+
+		case AST_EXPR:
+			visit_expression(s->expr, false);
+			break;
+
+		case AST_BREAK:
+		case AST_CONTINUE:
+			break;
+		}
+	}
+}
+
+// whether the value of variable `name` can outlive a run of `block`.
+bool var_escapes(ast_block *block, const char *name) {
+	watched = name;
+	watched_escapes = false;
+	analyze_escapes(block);
+	watched = 0;
+	return watched_escapes;
+}
@@ -0,0 +1,285 @@
+#include "file.h"
+#include "run.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __x86_64__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Files are never read into the heap. `read_file(path)` maps the file and
+ * returns the mapping itself as a string: the collector leaves alone strings
+ * outside its arena, same as it does literals, so nothing's copied, and pages
+ * are only read in as they're looked at. It's never unmapped, as nothing can
+ * tell when the string's dead, and a file with a nul in it reads as just what's
+ * before that.
+ *
+ * `lines(path)` returns a handle, an int, that `next_line` takes lines out of
+ * one at a time (without their '\n'), and null once there are none left, when
+ * the file's unmapped. Newlines are found 64 bytes at a time, as a bitmask,
+ * so a line costs a couple of bit operations and one allocation to copy it
+ * out; it's then garbage as soon as the program's done with it.
+ *
+ * Anything with no size to go by (a pipe, /dev/stdin, a /proc file) can't be
+ * mapped, so it's read to the end up front instead.
+ *
+ * `write_file(path, s)` writes s from where it is, to a new file of its own
+ * next to path (see `mkstemp`) that's then renamed over it, so a string mapped
+ * from path itself stays intact.
+ *
+ * With `-n`, each line of stdin is handed to the program's `process(line)`.
+ * Input's read a megabyte at a time, and if process can't keep its line (see
+ * `var_escapes`), every line's copied into the same buffer, so a run makes no
+ * garbage of its own.
+ */
+
+#define CHUNK 64
+#define RECORD_BUFFER (1 << 20)
+
+typedef struct {
+	char *base; // 0 once it's all been read
+	size_t size, mapped, pos;
+	size_t chunk; // where the 64 bytes `newlines` covers start
+	unsigned long long newlines; // a bit for each '\n' in the chunk that's not been used yet
+} lines;
+
+static __thread lines *readers; // a thread's handles are its own
+static __thread int nreaders, readers_cap;
+
+// pipes, ttys and /proc files have no size to map by, so they're read to the
+// end instead, into an anonymous mapping laid out the same as `map_file`'s.
+static char *read_all(int fd, const char *path, size_t *size, size_t *mapped) {
+	size_t cap = 1 << 16, len = 0;
+	char *buf = malloc(cap);
+	for (;;) {
+		if (len == cap) buf = realloc(buf, cap *= 2);
+		ssize_t n = read(fd, buf + len, cap - len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) {
+			close(fd);
+			free(buf);
+			die("couldn't read %s", path);
+		}
+		if (!n) break;
+		len += n;
+	}
+	close(fd);
+
+	size_t page = sysconf(_SC_PAGESIZE);
+	*size = len;
+	*mapped = (len + page) & ~(page - 1);
+	char *p = mmap(0, *mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		free(buf);
+		die("couldn't read %s", path);
+	}
+	memcpy(p, buf, len);
+	free(buf);
+	return p;
+}
+
+// maps `path` with a zero byte after it, so it's a nul terminated string as is.
+static char *map_file(const char *path, size_t *size, size_t *mapped) {
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) die("couldn't open %s", path);
+	if (fstat(fd, &st) < 0) {
+		close(fd); // as die might not be the end of us, see `basicast.h`
+		die("couldn't open %s", path);
+	}
+	if (!S_ISREG(st.st_mode) || !st.st_size) return read_all(fd, path, size, mapped); // /proc files say they're empty
+
+	size_t page = sysconf(_SC_PAGESIZE);
+	*size = st.st_size;
+	*mapped = (*size + page) & ~(page - 1);
+
+	// zeroed memory for all of it, then the file over its start.
+	char *p = mmap(0, *mapped, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	bool failed = p == MAP_FAILED || (*size && mmap(p, *size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED);
+	close(fd);
+	if (failed) {
+		if (p != MAP_FAILED) munmap(p, *mapped);
+		die("couldn't map %s", path);
+	}
+	madvise(p, *mapped, MADV_SEQUENTIAL);
+	return p;
+}
+
+static const char *path_arg(value path, char buf[8], const char *usage) {
+	if (classify(path) != V_STR) die("usage: %s", usage);
+	return str_chars(path, buf);
+}
+
+value read_file(value path) {
+	char buf[8];
+	size_t size, mapped;
+	char *p = map_file(path_arg(path, buf, "read_file(path)"), &size, &mapped);
+
+	// short strings have to be short ones, see `short_str`.
+	size_t len = strnlen(p, SHORT_STR_MAX + 1);
+	if (len > SHORT_STR_MAX) return str2value(p);
+
+	value v = short_str(p, len);
+	munmap(p, mapped);
+	return v;
+}
+
+// the `len` chars at s as a string, copied into `to` if it's given (with room
+// for the nul), or else the heap. a nul in them ends the string early.
+value string_of(const char *s, size_t len, char *to) {
+	// short strings have to be short ones, see `short_str`.
+	size_t head = strnlen(s, len <= SHORT_STR_MAX ? len : SHORT_STR_MAX + 1);
+	if (head <= SHORT_STR_MAX) return short_str(s, head);
+
+	if (!to) to = gc_alloc(GC_STR, len + 1);
+	memcpy(to, s, len);
+	to[len] = '\0';
+	return str2value(to);
+}
+
+#ifdef __x86_64__
+// a bit for each '\n' in the 64 bytes at p, which is 16 byte aligned.
+static unsigned long long find_newlines(const char *p) {
+	__m128i nl = _mm_set1_epi8('\n');
+	unsigned long long bits = 0;
+	for (int i = 0; i < CHUNK / 16; ++i) {
+		__m128i x = _mm_load_si128((const __m128i *) (p + 16 * i));
+		bits |= (unsigned long long) (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(x, nl)) << 16 * i;
+	}
+	return bits;
+}
+#else
+static unsigned long long find_newlines(const char *p) {
+	unsigned long long bits = 0;
+	for (int i = 0; i < CHUNK; ++i)
+		bits |= (unsigned long long) (p[i] == '\n') << i;
+	return bits;
+}
+#endif
+
+value open_lines(value path) {
+	char buf[8];
+	lines l = { 0 };
+	l.base = map_file(path_arg(path, buf, "lines(path)"), &l.size, &l.mapped);
+	l.newlines = find_newlines(l.base); // chunks never run past the mapping, it's whole pages
+
+	if (nreaders == readers_cap)
+		readers = realloc(readers, (readers_cap = readers_cap ? 2 * readers_cap : 4) * sizeof(lines));
+	readers[nreaders] = l;
+	return num2value(nreaders++);
+}
+
+value next_line(value handle) {
+	if (classify(handle) != V_INT || value2num(handle) < 0 || value2num(handle) >= nreaders)
+		die("usage: next_line(lines)");
+
+	lines *l = &readers[value2num(handle)];
+	if (!l->base) return VNULL;
+	if (l->pos >= l->size) {
+		munmap(l->base, l->mapped);
+		l->base = 0;
+		return VNULL;
+	}
+
+	size_t end;
+	for (;;) {
+		if (l->newlines) {
+			end = l->chunk + __builtin_ctzll(l->newlines);
+			l->newlines &= l->newlines - 1;
+			break;
+		}
+		if ((l->chunk += CHUNK) >= l->size) {
+			end = l->size; // the last line, with no '\n' after it
+			break;
+		}
+		l->newlines = find_newlines(l->base + l->chunk);
+	}
+
+	size_t pos = l->pos;
+	l->pos = end + 1;
+	return string_of(l->base + pos, end - pos, 0);
+}
+
+static mode_t umask_bits;
+static pthread_once_t umask_read = PTHREAD_ONCE_INIT;
+static void read_umask(void) {
+	umask(umask_bits = umask(0)); // there's no reading it without setting it, so it's done the once
+}
+
+static mode_t current_umask(void) {
+	pthread_once(&umask_read, read_umask);
+	return umask_bits;
+}
+
+value write_file(value path, value s) {
+	char buf[8], sbuf[8];
+	const char *name = path_arg(path, buf, "write_file(path, string)");
+	if (classify(s) != V_STR) die("usage: write_file(path, string)");
+	const char *chars = str_chars(s, sbuf);
+	size_t len = is_short_str(s) ? short_str_len(s) : strlen(chars);
+
+	// a name no one else has, in the same directory so the rename stays on one filesystem.
+	char *tmp = malloc(strlen(name) + 8);
+	strcpy(tmp, name);
+	strcat(tmp, ".XXXXXX");
+	int fd = mkstemp(tmp);
+	bool failed = fd < 0;
+
+	// mkstemp's file is only the owner's; give it path's mode, or a new file's.
+	struct stat st;
+	mode_t mode = stat(name, &st) == 0 ? st.st_mode & 07777 : 0666 & ~current_umask();
+	if (!failed && fchmod(fd, mode) < 0) failed = true;
+
+	for (size_t done = 0; !failed && done < len;) {
+		ssize_t n = write(fd, chars + done, len - done);
+		failed = n < 0 && errno != EINTR;
+		if (n > 0) done += n;
+	}
+	if (fd >= 0 && close(fd) < 0) failed = true;
+	if (!failed && rename(tmp, name) < 0) failed = true;
+	if (failed && fd >= 0) unlink(tmp);
+
+	free(tmp);
+	if (failed) die("couldn't write %s", name);
+	return num2value(len);
+}
+
+void process_records(int fd, value process, env *e) {
+	function *f = value2func(process);
+	bool reuse = !f->pure && !var_escapes(f->block, f->argv[0]); // a pure one might be memoized
+
+	size_t cap = RECORD_BUFFER, start = 0, end = 0, line_cap = 256;
+	char *buf = malloc(cap), *line = malloc(line_cap);
+	bool eof = false;
+	for (;;) {
+		char *nl = memchr(buf + start, '\n', end - start);
+		if (!nl && !eof) {
+			// keep the partial line, and read some more after it.
+			memmove(buf, buf + start, end - start);
+			end -= start;
+			start = 0;
+			if (end == cap) buf = realloc(buf, cap *= 2);
+
+			ssize_t n = read(fd, buf + end, cap - end);
+			if (n < 0 && errno != EINTR) die("couldn't read input");
+			if (n > 0) end += n;
+			eof = !n;
+			continue;
+		}
+		if (!nl && start == end) break;
+
+		size_t len = (nl ? nl - buf : end) - start;
+		if (reuse && len >= line_cap) line = realloc(line, line_cap = 2 * len);
+		value arg = string_of(buf + start, len, reuse ? line : 0);
+		start += len + !!nl;
+		call_value(process, 1, &arg, e);
+	}
+
+	free(buf);
+	free(line);
+}
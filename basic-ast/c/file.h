@@ -0,0 +1,13 @@
+#pragma once
+#include "value.h"
+
+// `read_file(path)`, `lines(path)` and `next_line(lines)`, and `write_file(path, string)`, see `file.c`.
+value read_file(value path);
+value open_lines(value path);
+value next_line(value lines);
+value write_file(value path, value s);
+value string_of(const char *s, size_t len, char *to); // `len` chars that needn't be nul terminated, `to` can be 0
+
+// `-n`: calls `process(line)` for each line read from fd.
+struct env;
+void process_records(int fd, value process, struct env *e);
@@ -0,0 +1,196 @@
+#include "run.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Rewrites a few common loop idioms into fused expression kinds that `run.c`
+ * has dedicated fast paths for:
+ *
+ *     i = i + 1           ->  AST_INCR        (also `i = i - 1`, any int literal)
+ *     i < length(x)       ->  AST_LTH_LENGTH  (both sides plain variables)
+ *     a[length(a)] = v    ->  AST_APPEND
+ *     x = x + y;          ->  AST_EXTEND      (only as a whole statement)
+ *
+ * Only `kind` changes, the node's fields are left exactly as they were, so
+ * anything that doesn't care about the fast path can treat them as the
+ * generic ASSIGN, BINOP and IDX_ASSIGN nodes they came from.
+ *
+ * Separately, a chain of three or more `+`s with a string literal in it,
+ * `"a" + b + "c" + d`, becomes a call to the "+" builtin with all of its
+ * operands, which builds the string in one go (see `add_chain`).
+ */
+
+__thread unsigned long fusion_rewrites[4], fusion_hits[4];
+
+static bool is_var(ast_expression *expr, const char *name) {
+	return expr->kind == AST_PRIM && expr->prim->kind == AST_VAR
+		&& (!name || !strcmp(expr->prim->ident, name));
+}
+
+// `length(<var>)`, returns the variable's name.
+static const char *length_of_var(ast_expression *expr) {
+	if (expr->kind != AST_PRIM || expr->prim->kind != AST_FNCALL) return 0;
+
+	ast_primary *call = expr->prim;
+	if (call->prim->kind != AST_VAR || builtin_kind(call->prim->ident) != BUILTIN_LENGTH) return 0;
+	if (call->amnt != 1 || !is_var(call->args[0], 0)) return 0;
+	return call->args[0]->prim->ident;
+}
+
+static bool is_str_literal(ast_primary *prim) {
+	return prim->kind == AST_LITERAL && classify(prim->value) == V_STR;
+}
+
+// `a + (b + (c + d))`, as parsed, into `+(a, b, c, d)`.
+static bool lower_add_chain(ast_expression *expr) {
+	int n = 1;
+	bool str = false;
+	ast_expression *x = expr;
+	for (; x->kind == AST_BINOP && x->binop == TK_ADD; x = x->rhs, ++n)
+		str |= is_str_literal(x->prim);
+	str |= x->kind == AST_PRIM && is_str_literal(x->prim);
+	if (n < 3 || !str) return false;
+
+	ast_primary *call = calloc(1, sizeof(ast_primary));
+	call->kind = AST_FNCALL;
+	call->prim = calloc(1, sizeof(ast_primary));
+	call->prim->kind = AST_VAR;
+	call->prim->ident = "+";
+	call->amnt = n;
+	call->args = malloc(n * sizeof(ast_expression *));
+
+	x = expr;
+	for (int i = 0; i < n - 1; x = x->rhs, ++i) {
+		call->args[i] = calloc(1, sizeof(ast_expression));
+		call->args[i]->kind = AST_PRIM;
+		call->args[i]->prim = x->prim;
+	}
+	call->args[n - 1] = x;
+
+	expr->kind = AST_PRIM;
+	expr->prim = call;
+	expr->rhs = 0;
+	return true;
+}
+
+static void fuse_expression(ast_expression *expr);
+static void fuse_primary(ast_primary *prim) {
+	switch (prim->kind) {
+	case AST_PAREN:
+		fuse_expression(prim->expr);
+		break;
+	case AST_INDEX:
+		fuse_expression(prim->expr);
+		// fallthru
+	case AST_NEG:
+	case AST_NOT:
+		fuse_primary(prim->prim);
+		break;
+	case AST_FNCALL:
+		fuse_primary(prim->prim);
+		// fallthru
+	case AST_ARY:
+	case AST_MAP:
+		for (int i = 0; i < prim->amnt; ++i)
+			fuse_expression(prim->args[i]);
+		break;
+	default:
+		break;
+	}
+}
+
+static void fuse_expression(ast_expression *expr) {
+	const char *name;
+	ast_expression *rhs = expr->rhs;
+
+	switch (expr->kind) {
+	case AST_ASSIGN:
+		if (rhs->kind == AST_BINOP && (rhs->binop == TK_ADD || rhs->binop == TK_SUB)
+			&& rhs->prim->kind == AST_VAR && !strcmp(rhs->prim->ident, expr->name)
+			&& rhs->rhs->kind == AST_PRIM && rhs->rhs->prim->kind == AST_LITERAL
+			&& is_number(rhs->rhs->prim->value)) {
+			expr->kind = AST_INCR;
+			++fusion_rewrites[AST_INCR - AST_INCR];
+			return;
+		}
+
+		// `x = x + ...` could still become an AST_EXTEND, which needs that first `+` as it is.
+		if (rhs->kind == AST_BINOP && rhs->binop == TK_ADD && rhs->prim->kind == AST_VAR
+			&& !strcmp(rhs->prim->ident, expr->name)) {
+			fuse_expression(rhs->rhs);
+			return;
+		}
+		break;
+
+	case AST_BINOP:
+		if (expr->binop == TK_LTH && expr->prim->kind == AST_VAR && length_of_var(rhs)) {
+			expr->kind = AST_LTH_LENGTH;
+			++fusion_rewrites[AST_LTH_LENGTH - AST_INCR];
+			return;
+		}
+		if (lower_add_chain(expr)) {
+			fuse_primary(expr->prim);
+			return;
+		}
+		fuse_primary(expr->prim);
+		break;
+
+	case AST_IDX_ASSIGN:
+		if (expr->prim->kind == AST_VAR && (name = length_of_var(expr->index))
+			&& !strcmp(name, expr->prim->ident)) {
+			expr->kind = AST_APPEND;
+			++fusion_rewrites[AST_APPEND - AST_INCR];
+		} else {
+			fuse_primary(expr->prim);
+			fuse_expression(expr->index);
+		}
+		break;
+
+	case AST_PRIM:
+		fuse_primary(expr->prim);
+		return;
+
+	default:
+		return;
+	}
+
+	fuse_expression(rhs);
+}
+
+void fuse_idioms(ast_block *block) {
+	for (int i = 0; i < block->amnt; ++i) {
+		ast_statement *s = block->stmts[i];
+
+		switch (s->kind) {
+		case AST_IF:
+			if (s->else_body) fuse_idioms(s->else_body);
+			// fallthru
+		case AST_WHILE:
+			fuse_idioms(s->body);
+			// fallthru
+		case AST_RETURN:
+			if (s->expr) fuse_expression(s->expr);
+			break;
+
+		// its value is thrown away, so `x` can be grown in place, see `run_extend`.
+		case AST_EXPR:
+			fuse_expression(s->expr);
+			if (s->expr->kind == AST_ASSIGN && s->expr->rhs->kind == AST_BINOP
+				&& s->expr->rhs->binop == TK_ADD && s->expr->rhs->prim->kind == AST_VAR
+				&& !strcmp(s->expr->rhs->prim->ident, s->expr->name)) {
+				s->expr->kind = AST_EXTEND;
+				++fusion_rewrites[AST_EXTEND - AST_INCR];
+			}
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+void dump_fusion_stats(FILE *out) {
+	static const char *names[] = { "increment-local", "compare-local-with-length", "append-to-array", "extend-in-place" };
+
+	for (int i = 0; i < 4; ++i)
+		fprintf(out, "%-26s %6lu rewritten, %12lu hits\n", names[i], fusion_rewrites[i], fusion_hits[i]);
+}
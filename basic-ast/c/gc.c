@@ -0,0 +1,916 @@
+#include "gc.h"
+#include "env.h"
+#include "memo.h"
+#include "shared.h"
+#include <limits.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Generational heap. New strings and arrays are bump-allocated into a nursery
+ * of GC_BLOCK_SIZE blocks. Once it's full, a minor collection copies whatever's
+ * still reachable into the old space and the nursery starts over empty, so
+ * short-lived garbage costs nothing to collect.
+ *
+ * Roots are found precisely where we can (call frames, memo caches, the stack
+ * engine's value stack) and conservatively everywhere else: the C stack,
+ * registers, JIT frames and the scratch region. A nursery block anything
+ * conservatively points into can't be moved, so it's promoted in place instead,
+ * as in Bartlett's mostly-copying collector.
+ *
+ * Old objects pointing at young ones are found through a write barrier:
+ * `index_assign` remembers old arrays it stores into, and `assign_var` remembers
+ * the globals it stores young objects into.
+ *
+ * The old space, which functions are allocated straight into, is collected by
+ * an incremental tri-color mark & sweep, in slices of about `gc_pause_budget`
+ * microseconds run from allocation points and loop back-edges (`gc_safepoint`):
+ *   - marking grays the precise roots, then each slice blackens gray objects
+ *     until its time is up. the array write barrier re-grays black arrays that
+ *     get stored into, and anything promoted meanwhile starts out gray, so no
+ *     black object ever points at a white one.
+ *   - once nothing's gray, one last step stops the world: a minor collection
+ *     empties the nursery, then the roots (conservative ones too) are grayed
+ *     again and drained. that's the only pause the budget doesn't bound, but
+ *     it only has to redo whatever changed since the start.
+ *   - sweeping walks a few blocks per slice, turning runs of dead objects into
+ *     holes the old space allocates from, and handing back empty blocks.
+ * Marks are an epoch bit that's flipped every cycle, so nothing ever has to be
+ * unmarked, and objects allocated mid-cycle are simply born marked.
+ *
+ * Most of what gets promoted is small and comes in a handful of sizes (array
+ * headers, functions, short strings), so those go into slabs: blocks cut into
+ * equal slots of one size class. A freed slot is reused as is by the next
+ * object of its class, where a hole would have to be split, and slowly break
+ * down into pieces too small for anything.
+ */
+
+enum { BLK_FREE, BLK_NURSERY, BLK_PINNED, BLK_OLD, BLK_SLAB, BLK_LARGE, BLK_LARGE_TAIL };
+enum { IDLE, MARKING, SWEEPING };
+
+#define LARGE_OBJECT (GC_BLOCK_SIZE / 4)
+#define FORWARDED 1
+#define REMEMBERED 2
+#define SEEN 4
+#define MARK 16
+#define GRAY 32 // on the mark stack
+#define HOLE 0xFF // the kind of a run of dead objects, left behind by the sweeper
+
+// a cycle starts once the old space has grown past twice what survived the last one, or this.
+#ifndef GC_OLD_MIN
+#define GC_OLD_MIN ((size_t) GC_NURSERY_BLOCKS * GC_BLOCK_SIZE)
+#endif
+#define SAFEPOINT_INTERVAL 4096 // loop back-edges between slices
+#define NBUCKETS 32
+
+// the slab size classes. everything's a multiple of 8, which keeps values' tag bits free.
+static const unsigned short class_size[] = { 8, 16, 24, 32, 48, 64, 96, 128, 192, 256 };
+#define NCLASSES (int) (sizeof(class_size) / sizeof(*class_size))
+#define SLAB_MAX (LARGE_OBJECT < 256 ? LARGE_OBJECT : 256)
+
+int gc_pause_budget = GC_PAUSE_BUDGET;
+__thread int gc_countdown = INT_MAX;
+
+struct heap {
+	char *arena, *mapping; // mapping is where the arena's reservation really starts
+	size_t nblocks, frontier;
+	unsigned char *kind; // BLK_*, per block
+	unsigned *top; // how many bytes of each block are in use
+	size_t nfree, rover; // free blocks below the frontier, and where to look for them next
+
+	size_t nursery[GC_NURSERY_BLOCKS];
+	int cur;
+	char *bump, *limit;
+	size_t old; // the block promoted objects are being bump allocated into
+	gc_header *holes[NBUCKETS]; // by log2 of their size, linked through their first word
+	unsigned char *cls; // the size class of each slab
+	size_t slab[NCLASSES]; // the slab each class is bump allocated into
+	gc_header *slots[NCLASSES]; // free slots of each class, linked like holes
+
+	struct env *e;
+	void *stack_base;
+	gc_roots *roots;
+
+	void **remembered; // old arrays and maps
+	size_t nremembered, remembered_cap;
+	int *globals; // remembered global indices, each at most once
+	unsigned char *dirty;
+	int nglobals, dirty_cap;
+
+	void **gray;
+	size_t ngray, gray_cap;
+
+	// the old space's collector.
+	int state;
+	unsigned char epoch; // 0 or MARK, what a marked object's MARK bit is this cycle
+	void **marks; // gray arrays and maps
+	size_t nmarks, marks_cap;
+	void *scanning; // one that's being blackened over several slices
+	int scanned;
+	size_t sweep; // the next block to sweep
+	size_t old_bytes, threshold;
+	unsigned char *visited; // blocks already grayed conservatively
+
+	unsigned long minors, pinned, cycles, slices, released, slab_allocs[NCLASSES];
+	size_t allocated, promoted, swept;
+	size_t kept; // old blocks the sweep has kept this cycle
+	double start, fragmentation; // of the old space, after the last sweep
+	double pause_total, pause_max, *pauses;
+	size_t npauses, pauses_cap;
+};
+
+// the heap that's allocated from and collected: the program's, or an embedded interpreter's.
+// each thread has its own in use, see `basicast.h`.
+static heap main_heap = { .threshold = GC_OLD_MIN };
+static __thread heap *gc = &main_heap;
+
+#define BLOCK(p) ((size_t) ((char *) (p) - gc->arena) / GC_BLOCK_SIZE)
+#define BLOCK_ADDR(b) (gc->arena + (b) * GC_BLOCK_SIZE)
+#define HEADER(p) GC_HEADER(p)
+#define NEXT(h) ((gc_header *) ((char *) ((h) + 1) + (h)->size))
+#define MARKED(h) (((h)->flags & MARK) == gc->epoch)
+#define HEAP_TAG(v) (((v) & 7) == 0 || ((v) & 7) == 2 || ((v) & 7) == 5) // strings, arrays and maps
+
+static bool in_arena(const void *p) {
+	return gc->arena && (char *) p >= gc->arena && (char *) p < gc->arena + gc->frontier * GC_BLOCK_SIZE;
+}
+
+static bool in_nursery(const void *p) {
+	return in_arena(p) && gc->kind[BLOCK(p)] == BLK_NURSERY;
+}
+
+static bool in_old(const void *p) {
+	return in_arena(p) && (gc->kind[BLOCK(p)] == BLK_OLD || gc->kind[BLOCK(p)] == BLK_SLAB || gc->kind[BLOCK(p)] == BLK_LARGE);
+}
+
+// the object after `h` in old block `b`. slab slots are all the same size, whatever's in them.
+static gc_header *next_in(size_t b, gc_header *h) {
+	if (gc->kind[b] == BLK_SLAB)
+		return (gc_header *) ((char *) (h + 1) + class_size[gc->cls[b]]);
+	return NEXT(h);
+}
+
+static void grow(void **buf, size_t *cap, size_t need, size_t size) {
+	if (need > *cap)
+		*buf = realloc(*buf, (*cap = *cap * 2 > need ? *cap * 2 : need) * size);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the first `n` free blocks in a row in [from, to), or SIZE_MAX.
+static size_t find_free(size_t from, size_t to, size_t n) {
+	for (size_t b = from, len = 0; b < to; ++b)
+		if ((len = gc->kind[b] == BLK_FREE ? len + 1 : 0) == n)
+			return b - n + 1;
+	return SIZE_MAX;
+}
+
+static size_t new_blocks(int kind, size_t n) {
+	size_t b = SIZE_MAX;
+	if (gc->nfree >= n && (b = find_free(gc->rover, gc->frontier, n)) == SIZE_MAX)
+		b = find_free(0, gc->rover + n - 1 < gc->frontier ? gc->rover + n - 1 : gc->frontier, n);
+
+	if (b != SIZE_MAX) {
+		gc->nfree -= n;
+		gc->rover = b + n;
+	} else {
+		if (gc->frontier + n > gc->nblocks)
+			die("out of memory: the %llu byte heap is full", (unsigned long long) GC_ARENA_SIZE);
+		b = gc->frontier;
+		gc->frontier += n;
+	}
+
+	gc->kind[b] = kind;
+	for (size_t i = 1; i < n; ++i)
+		gc->kind[b + i] = BLK_LARGE_TAIL;
+	gc->top[b] = 0;
+	return b;
+}
+
+static void free_blocks(size_t b, size_t n) {
+	memset(gc->kind + b, BLK_FREE, n);
+	gc->top[b] = 0;
+	gc->nfree += n;
+	gc->released += n;
+}
+
+static void init_arena(void) {
+	char *p = mmap(0, GC_ARENA_SIZE + GC_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED)
+		die("couldn't reserve the heap");
+
+	gc->mapping = p;
+	gc->arena = (char *) (((size_t) p + GC_BLOCK_SIZE - 1) & ~(size_t) (GC_BLOCK_SIZE - 1));
+	gc->nblocks = GC_ARENA_SIZE / GC_BLOCK_SIZE;
+	gc->kind = calloc(gc->nblocks, 1);
+	gc->top = calloc(gc->nblocks, sizeof(unsigned));
+	gc->visited = calloc(gc->nblocks, 1);
+	gc->cls = calloc(gc->nblocks, 1);
+	for (int c = 0; c < NCLASSES; ++c)
+		gc->slab[c] = SIZE_MAX;
+	gc->start = now();
+
+	for (int i = 0; i < GC_NURSERY_BLOCKS; ++i)
+		gc->nursery[i] = new_blocks(BLK_NURSERY, 1);
+	gc->bump = BLOCK_ADDR(gc->nursery[0]);
+	gc->limit = gc->bump + GC_BLOCK_SIZE;
+}
+
+void gc_init(struct env *e, void *stack_base) {
+	if (!gc->arena) init_arena();
+	gc->e = e;
+	gc->stack_base = stack_base;
+}
+
+heap *gc_new_heap(void) {
+	heap *h = calloc(1, sizeof(heap));
+	h->threshold = GC_OLD_MIN;
+	return h;
+}
+
+heap *gc_use_heap(heap *h) {
+	heap *was = gc;
+	gc = h;
+	return was;
+}
+
+void gc_free_heap(heap *h) {
+	if (h->arena) munmap(h->mapping, GC_ARENA_SIZE + GC_BLOCK_SIZE);
+	free(h->kind);
+	free(h->top);
+	free(h->visited);
+	free(h->cls);
+	free(h->remembered);
+	free(h->globals);
+	free(h->dirty);
+	free(h->gray);
+	free(h->marks);
+	free(h->pauses);
+	free(h);
+}
+
+gc_roots *gc_top_roots(void) {
+	return gc->roots;
+}
+
+void gc_push_roots(gc_roots *roots) {
+	roots->next = gc->roots;
+	gc->roots = roots;
+}
+
+void gc_pop_roots(gc_roots *roots) {
+	gc->roots = roots->next;
+}
+
+static gc_header *place(char *at, int kind, size_t size) {
+	gc_header *h = (gc_header *) at;
+	h->size = size;
+	h->kind = kind;
+	h->flags = 0;
+	h->refs = 0;
+	return h;
+}
+
+static void push_mark(gc_header *h) {
+	h->flags |= GRAY;
+	grow((void **) &gc->marks, &gc->marks_cap, gc->nmarks + 1, sizeof(void *));
+	gc->marks[gc->nmarks++] = h + 1;
+}
+
+// old objects are born marked; arrays and maps are gray while marking, as they might hold white objects.
+static void *born(gc_header *h) {
+	h->flags = (h->flags & ~MARK) | gc->epoch;
+	if (gc->state == MARKING && (h->kind == GC_ARY || h->kind == GC_MAP) && !(h->flags & GRAY))
+		push_mark(h);
+	return h + 1;
+}
+
+static void make_hole(gc_header *h, void *end) {
+	place((char *) h, HOLE, (char *) end - (char *) (h + 1));
+	if (h->size < sizeof(gc_header *)) return; // too small to ever reuse, until it's coalesced
+
+	int k = 63 - __builtin_clzll(h->size);
+	*(gc_header **) (h + 1) = gc->holes[k];
+	gc->holes[k] = h;
+}
+
+static gc_header *take_hole(int kind, size_t size) {
+	for (int k = 64 - __builtin_clzll(size - 1); k < NBUCKETS; ++k) {
+		gc_header *h = gc->holes[k];
+		if (!h) continue;
+		gc->holes[k] = *(gc_header **) (h + 1);
+
+		void *end = NEXT(h);
+		if (h->size - size >= sizeof(gc_header) + sizeof(value)) {
+			place((char *) h, kind, size);
+			make_hole(NEXT(h), end);
+		} else {
+			// the leftover is too small to be a hole, the object gets it. zeroed, as it's scanned.
+			place((char *) h, kind, h->size);
+			memset((char *) (h + 1) + size, 0, h->size - size);
+		}
+		return h;
+	}
+	return 0;
+}
+
+// a free slot of the smallest class that fits, or a new one off the end of the class's slab.
+static gc_header *slab_alloc(int kind, size_t size) {
+	int c = 0;
+	while (class_size[c] < size) ++c;
+	++gc->slab_allocs[c];
+
+	gc_header *h = gc->slots[c];
+	if (h) {
+		gc->slots[c] = *(gc_header **) (h + 1);
+		return place((char *) h, kind, size);
+	}
+
+	size_t stride = sizeof(gc_header) + class_size[c];
+	if (gc->slab[c] == SIZE_MAX || gc->top[gc->slab[c]] + stride > GC_BLOCK_SIZE) {
+		gc->slab[c] = new_blocks(BLK_SLAB, 1);
+		gc->cls[gc->slab[c]] = c;
+	}
+	h = place(BLOCK_ADDR(gc->slab[c]) + gc->top[gc->slab[c]], kind, size);
+	gc->top[gc->slab[c]] += stride;
+	return h;
+}
+
+// promoted objects (and functions) go into slabs or holes, or get bump allocated into old blocks.
+static void *old_alloc(int kind, size_t size) {
+	gc_header *h;
+	gc->old_bytes += sizeof(gc_header) + size;
+
+	if (size <= SLAB_MAX)
+		return born(slab_alloc(kind, size));
+
+	if (size > LARGE_OBJECT) {
+		size_t b = new_blocks(BLK_LARGE, (size + sizeof(gc_header) + GC_BLOCK_SIZE - 1) / GC_BLOCK_SIZE);
+		gc->top[b] = size + sizeof(gc_header);
+		return born(place(BLOCK_ADDR(b), kind, size));
+	}
+
+	if ((h = take_hole(kind, size)))
+		return born(h);
+
+	if (!gc->old || gc->top[gc->old] + sizeof(gc_header) + size > GC_BLOCK_SIZE)
+		gc->old = new_blocks(BLK_OLD, 1);
+
+	h = place(BLOCK_ADDR(gc->old) + gc->top[gc->old], kind, size);
+	gc->top[gc->old] += sizeof(gc_header) + size;
+	return born(h);
+}
+
+void *gc_alloc(int kind, size_t size) {
+	if (!gc->arena) init_arena();
+	size = size < sizeof(value) ? sizeof(value) : (size + sizeof(value) - 1) & ~(sizeof(value) - 1);
+	gc->allocated += size;
+
+	void *p;
+	if (size > LARGE_OBJECT || kind == GC_FUNC) { // functions never move, JIT code points at them
+		p = old_alloc(kind, size);
+		if (kind != GC_STR) memset(p, 0, size);
+		if (gc->state != IDLE || gc->old_bytes >= gc->threshold) gc_slice();
+		return p;
+	}
+
+	if (gc->bump + sizeof(gc_header) + size > gc->limit) {
+		gc->top[gc->nursery[gc->cur]] = gc->bump - BLOCK_ADDR(gc->nursery[gc->cur]);
+		if (++gc->cur == GC_NURSERY_BLOCKS)
+			gc_collect();
+		gc->bump = BLOCK_ADDR(gc->nursery[gc->cur]);
+		gc->limit = gc->bump + GC_BLOCK_SIZE;
+		if (gc->state != IDLE || gc->old_bytes >= gc->threshold) gc_slice();
+	}
+
+	p = place(gc->bump, kind, size) + 1;
+	gc->bump += sizeof(gc_header) + size;
+
+	// anything holding values has to be valid for the collector straight away.
+	if (kind != GC_STR) memset(p, 0, size);
+	return p;
+}
+
+static void record_pause(double pause) {
+	gc->pause_total += pause;
+	if (pause > gc->pause_max) gc->pause_max = pause;
+	grow((void **) &gc->pauses, &gc->pauses_cap, gc->npauses + 1, sizeof(double));
+	gc->pauses[gc->npauses++] = pause;
+}
+
+/* the nursery */
+
+static void evacuate_ptr(void **slot) {
+	char *p = *slot;
+	if (!in_nursery(p))
+		return;
+
+	gc_header *h = HEADER(p);
+	if (h->flags & FORWARDED) {
+		*slot = *(void **) p;
+		return;
+	}
+
+	void *to = old_alloc(h->kind, h->size);
+	memcpy(to, p, h->size);
+	HEADER(to)->refs = h->refs;
+	HEADER(to)->flags |= h->flags & (SEEN | GC_ZEROED | GC_SLICED);
+	gc->promoted += h->size;
+
+	h->flags |= FORWARDED;
+	*slot = *(void **) p = to;
+
+	grow((void **) &gc->gray, &gc->gray_cap, gc->ngray + 1, sizeof(void *));
+	gc->gray[gc->ngray++] = to;
+}
+
+static void evacuate(value *v) {
+	if (!HEAP_TAG(*v))
+		return;
+
+	int tag = *v & 7;
+	void *p = (void *) (*v & ~7);
+	evacuate_ptr(&p);
+	*v = (value) p | tag;
+}
+
+static void scan_array(array *a) {
+	// a view's `eles` points into the middle of its buffer, it's the buffer that moves.
+	value *buf = ary_buffer(a);
+	bool young = in_nursery(buf);
+	evacuate_ptr((void **) &buf);
+	a->eles = buf + (is_view(a) ? -a->cap - 1 : 0);
+
+	// a young buffer gets scanned once it's copied, an old one has to be done here.
+	if (!young && a->eles)
+		for (int i = 0; i < a->len; ++i)
+			evacuate(&a->eles[i]);
+}
+
+static void scan_map(hashmap *m) {
+	bool young = in_nursery(m->slots);
+	evacuate_ptr((void **) &m->slots);
+	evacuate_ptr((void **) &m->ctrl);
+
+	if (!young && m->slots)
+		for (int i = 0; i < 2 * m->cap; ++i)
+			evacuate(&m->slots[i]);
+}
+
+static void scan_object(void *p) {
+	gc_header *h = HEADER(p);
+
+	switch (h->kind) {
+	case GC_ARY:
+		scan_array(p);
+		break;
+	case GC_MAP:
+		scan_map(p);
+		break;
+	case GC_VALUES:
+		for (value *v = p, *end = v + h->size / sizeof(value); v != end; ++v)
+			evacuate(v);
+		break;
+	}
+}
+
+static void pin(const char *p) {
+	if (in_arena(p) && gc->kind[BLOCK(p)] == BLK_NURSERY) {
+		gc->kind[BLOCK(p)] = BLK_PINNED;
+		++gc->pinned;
+	}
+}
+
+static void scan_conservatively(const void *from, const void *to, void (*visit)(const char *)) {
+	for (char *const *p = from; (void *) (p + 1) <= to; ++p) {
+		visit(*p);
+		visit(*p - 1); // a pointer just past the end of an object
+	}
+}
+
+static void minor(void) {
+	if (gc->cur < GC_NURSERY_BLOCKS) // otherwise `gc_alloc` already did this
+		gc->top[gc->nursery[gc->cur]] = gc->bump - BLOCK_ADDR(gc->nursery[gc->cur]);
+
+	if (gc->e) {
+		// 1. pin everything the C stack, registers or scratch region might point into.
+		jmp_buf regs;
+		setjmp(regs);
+		scan_conservatively(&regs, gc->stack_base, pin);
+		scan_conservatively(gc->e->scratch, gc->e->scratch + gc->e->scratch_len, pin);
+
+		// 2. copy out everything the roots point at. pinned objects become old where they are.
+		for (int i = 0; i < GC_NURSERY_BLOCKS; ++i) {
+			size_t b = gc->nursery[i];
+			if (gc->kind[b] != BLK_PINNED) continue;
+
+			for (gc_header *h = (gc_header *) BLOCK_ADDR(b), *end = (gc_header *) ((char *) h + gc->top[b]); h < end; h = NEXT(h)) {
+				scan_object(born(h));
+				gc->old_bytes += sizeof(gc_header) + h->size;
+			}
+		}
+
+		for (int sp = 1; sp <= gc->e->sp; ++sp)
+			for (int i = 0; i < gc->e->stackframes[sp].len; ++i)
+				evacuate(&gc->e->stackframes[sp].entries[i].v);
+
+		for (int i = 0; i < gc->nglobals; ++i) {
+			evacuate(&gc->e->globals.entries[gc->globals[i]].v);
+			gc->dirty[gc->globals[i]] = 0;
+		}
+		gc->nglobals = 0;
+
+		for (size_t i = 0; i < gc->nremembered; ++i) {
+			HEADER(gc->remembered[i])->flags &= ~REMEMBERED;
+			scan_object(gc->remembered[i]);
+		}
+		gc->nremembered = 0;
+
+		for (gc_roots *r = gc->roots; r; r = r->next)
+			for (size_t i = 0; i < *r->len; ++i)
+				evacuate(&(*r->vals)[i]);
+
+		memo_visit_roots(evacuate);
+
+		// 3. and everything those point at, transitively.
+		while (gc->ngray)
+			scan_object(gc->gray[--gc->ngray]);
+	} else {
+		// nothing's registered the roots, so nothing can be moved: keep it all.
+		for (int i = 0; i < GC_NURSERY_BLOCKS; ++i)
+			gc->kind[gc->nursery[i]] = BLK_PINNED;
+	}
+
+	// pinned blocks join the old space as they are, everything else is free again.
+	for (int i = 0; i < GC_NURSERY_BLOCKS; ++i) {
+		if (gc->kind[gc->nursery[i]] == BLK_PINNED) {
+			gc->kind[gc->nursery[i]] = BLK_OLD;
+			gc->nursery[i] = new_blocks(BLK_NURSERY, 1);
+		}
+		gc->top[gc->nursery[i]] = 0;
+	}
+
+	gc->cur = 0;
+	gc->bump = BLOCK_ADDR(gc->nursery[0]);
+	gc->limit = gc->bump + GC_BLOCK_SIZE;
+	++gc->minors;
+}
+
+void gc_collect(void) {
+	double start = now();
+	minor();
+	record_pause(now() - start);
+}
+
+/* the old space */
+
+static void shade_object(void *p) {
+	gc_header *h = HEADER(p);
+	if (MARKED(h)) return;
+
+	h->flags ^= MARK;
+	if (h->kind == GC_ARY || h->kind == GC_MAP) push_mark(h);
+}
+
+static void shade(value v) {
+	void *p = (void *) (v & ~7);
+	if (v > VUNDEF && ((v & 7) == 1 || HEAP_TAG(v)) && in_old(p))
+		shade_object(p);
+}
+
+static void shade_slot(value *v) {
+	shade(*v);
+}
+
+// conservatively, everything in an old block anything points into is a root.
+static void shade_block(const char *p) {
+	if (!in_arena(p)) return;
+
+	size_t b = BLOCK(p);
+	while (gc->kind[b] == BLK_LARGE_TAIL) --b;
+	if ((gc->kind[b] != BLK_OLD && gc->kind[b] != BLK_SLAB && gc->kind[b] != BLK_LARGE) || gc->visited[b])
+		return;
+
+	gc->visited[b] = 1;
+	for (gc_header *h = (gc_header *) BLOCK_ADDR(b), *end = (gc_header *) ((char *) h + gc->top[b]); h < end; h = next_in(b, h))
+		if (h->kind != HOLE)
+			shade_object(h + 1);
+}
+
+static void shade_roots(void) {
+	for (int sp = 1; sp <= gc->e->sp; ++sp)
+		for (int i = 0; i < gc->e->stackframes[sp].len; ++i)
+			shade(gc->e->stackframes[sp].entries[i].v);
+
+	for (int i = 0; i < gc->e->globals.len; ++i)
+		shade(gc->e->globals.entries[i].v);
+
+	for (gc_roots *r = gc->roots; r; r = r->next)
+		for (size_t i = 0; i < *r->len; ++i)
+			shade((*r->vals)[i]);
+
+	memo_visit_roots(shade_slot);
+}
+
+static void shade_buffer(void *p) {
+	if (in_old(p)) shade_object(p);
+}
+
+// the values a gray array or map holds, as of now: a store might've moved them.
+static value *gray_values(void *p, int *n) {
+	if (HEADER(p)->kind == GC_MAP) {
+		hashmap *m = p;
+		*n = 2 * m->cap;
+		return m->slots;
+	}
+	array *a = p;
+	*n = a->len;
+	return a->eles;
+}
+
+// blackens gray arrays and maps (a few hundred values at a time) until `deadline`,
+// or for good if it's 0. returns whether there's nothing gray left.
+static bool mark(double deadline) {
+	for (unsigned n = 1;; ++n) {
+		if (!gc->scanning) {
+			if (!gc->nmarks) return true;
+			gc->scanning = gc->marks[--gc->nmarks];
+			gc->scanned = 0;
+			HEADER(gc->scanning)->flags &= ~GRAY;
+			if (HEADER(gc->scanning)->kind == GC_MAP) {
+				shade_buffer(((hashmap *) gc->scanning)->slots);
+				shade_buffer(((hashmap *) gc->scanning)->ctrl);
+			} else {
+				shade_buffer(ary_buffer(gc->scanning));
+			}
+		}
+
+		int len;
+		value *vals = gray_values(gc->scanning, &len);
+		int end = len - gc->scanned > 256 ? gc->scanned + 256 : len;
+		while (gc->scanned < end)
+			shade(vals[gc->scanned++]);
+		if (gc->scanned >= len) gc->scanning = 0;
+
+		if (deadline && n % 16 == 0 && now() > deadline)
+			return false;
+	}
+}
+
+static void finish_marking(void) {
+	minor(); // so nothing young can be hiding old objects
+
+	jmp_buf regs;
+	setjmp(regs);
+	memset(gc->visited, 0, gc->frontier);
+	scan_conservatively(&regs, gc->stack_base, shade_block);
+	scan_conservatively(gc->e->scratch, gc->e->scratch + gc->e->scratch_len, shade_block);
+	shade_roots();
+	mark(0);
+
+	// every hole and free slot is found again by the sweep.
+	memset(gc->holes, 0, sizeof(gc->holes));
+	memset(gc->slots, 0, sizeof(gc->slots));
+	gc->state = SWEEPING;
+	gc->sweep = 0;
+	gc->old_bytes = 0;
+	gc->kept = 0;
+}
+
+// gives back the pages of a freed run. only whole ones, blocks can be smaller than a page.
+static void discard(void *from, void *to) {
+	uintptr_t page = sysconf(_SC_PAGESIZE), lo = ((uintptr_t) from + page - 1) & ~(page - 1), hi = (uintptr_t) to & ~(page - 1);
+	if (lo < hi) madvise((void *) lo, hi - lo, MADV_DONTNEED);
+}
+
+static void destroy(gc_header *h) {
+	gc->swept += h->size;
+	if (h->kind == GC_FUNC && ((function *) (h + 1))->memo)
+		free_memo(((function *) (h + 1))->memo);
+}
+
+// returns how many blocks it covered.
+static size_t sweep_block(size_t b) {
+	gc_header *h = (gc_header *) BLOCK_ADDR(b), *end = (gc_header *) ((char *) h + gc->top[b]), *hole = 0;
+	bool live = false;
+
+	switch (gc->kind[b]) {
+	case BLK_LARGE:;
+		size_t n = (h->size + sizeof(gc_header) + GC_BLOCK_SIZE - 1) / GC_BLOCK_SIZE;
+		if (MARKED(h)) {
+			gc->old_bytes += sizeof(gc_header) + h->size;
+			gc->kept += n;
+		} else {
+			destroy(h);
+			discard(h, (char *) h + n * GC_BLOCK_SIZE);
+			free_blocks(b, n);
+		}
+		return n;
+
+	case BLK_OLD:
+		for (; h < end; h = NEXT(h)) {
+			if (h->kind != HOLE && MARKED(h)) {
+				if (hole) make_hole(hole, h);
+				hole = 0;
+				live = true;
+				gc->old_bytes += sizeof(gc_header) + h->size;
+				continue;
+			}
+
+			if (h->kind != HOLE) destroy(h);
+			if (!hole) hole = h;
+		}
+
+		// a dead tail of the block being bump allocated into can just be allocated again,
+		// and the block itself stays, even if it's empty.
+		if (b == gc->old) {
+			if (hole) gc->top[b] = (char *) hole - BLOCK_ADDR(b);
+		} else if (!live) {
+			free_blocks(b, 1);
+			return 1;
+		} else if (hole)
+			make_hole(hole, end);
+		++gc->kept;
+		return 1;
+
+	case BLK_SLAB:;
+		int c = gc->cls[b];
+		gc_header *first = 0, *last = 0; // the free slots, only handed out if the slab's kept
+		for (; h < end; h = next_in(b, h)) {
+			if (h->kind != HOLE && MARKED(h)) {
+				live = true;
+				gc->old_bytes += sizeof(gc_header) + h->size;
+				continue;
+			}
+
+			if (h->kind != HOLE) destroy(h);
+			place((char *) h, HOLE, class_size[c]);
+			*(gc_header **) (h + 1) = first;
+			if (!first) last = h;
+			first = h;
+		}
+
+		if (!live && b != gc->slab[c]) {
+			free_blocks(b, 1);
+			return 1;
+		}
+		if (last) {
+			*(gc_header **) (last + 1) = gc->slots[c];
+			gc->slots[c] = first;
+		}
+		++gc->kept;
+		return 1;
+	}
+
+	return 1;
+}
+
+static bool sweep(double deadline) {
+	for (unsigned n = 1; gc->sweep < gc->frontier; ++n) {
+		gc->sweep += sweep_block(gc->sweep);
+		if (n % 8 == 0 && now() > deadline)
+			return false;
+	}
+	return true;
+}
+
+void gc_slice(void) {
+	gc_countdown = INT_MAX;
+	if (!gc->e || (gc->state == IDLE && gc->old_bytes < gc->threshold))
+		return;
+
+	double start = now(), deadline = start + gc_pause_budget / 1e6;
+	switch (gc->state) {
+	case IDLE:
+		gc->epoch ^= MARK; // everything's white again
+		gc->state = MARKING;
+		shade_roots();
+		// fallthru
+
+	case MARKING:
+		if (mark(deadline)) finish_marking();
+		break;
+
+	case SWEEPING:
+		if (sweep(deadline)) {
+			gc->state = IDLE;
+			gc->fragmentation = gc->kept ? 1 - (double) gc->old_bytes / (gc->kept * GC_BLOCK_SIZE) : 0;
+			gc->threshold = 2 * gc->old_bytes > GC_OLD_MIN ? 2 * gc->old_bytes : GC_OLD_MIN;
+			++gc->cycles;
+		}
+		break;
+	}
+
+	if (gc->state != IDLE) gc_countdown = SAFEPOINT_INTERVAL;
+	++gc->slices;
+	record_pause(now() - start);
+}
+
+/* barriers */
+
+static void barrier(void *a) {
+	if (!in_arena(a) || gc->kind[BLOCK(a)] == BLK_NURSERY)
+		return;
+
+	// a black array or map that's been stored into has to be looked at again.
+	gc_header *h = HEADER(a);
+	if (gc->state == MARKING && MARKED(h) && !(h->flags & GRAY))
+		push_mark(h);
+
+	if (h->flags & REMEMBERED)
+		return;
+
+	h->flags |= REMEMBERED;
+	grow((void **) &gc->remembered, &gc->remembered_cap, gc->nremembered + 1, sizeof(void *));
+	gc->remembered[gc->nremembered++] = a;
+}
+
+void gc_array_barrier(array *a) {
+	barrier(a);
+}
+
+void gc_map_barrier(hashmap *m) {
+	barrier(m);
+}
+
+void gc_global_barrier(int idx, value v) {
+	if (!HEAP_TAG(v) || !in_nursery((void *) (v & ~7)))
+		return;
+
+	if (idx >= gc->dirty_cap) {
+		size_t cap = gc->dirty_cap;
+		grow((void **) &gc->dirty, &cap, idx + 1, 1);
+		memset(gc->dirty + gc->dirty_cap, 0, cap - gc->dirty_cap);
+		gc->dirty_cap = cap;
+		gc->globals = realloc(gc->globals, cap * sizeof(int));
+	}
+
+	if (!gc->dirty[idx]) {
+		gc->dirty[idx] = 1;
+		gc->globals[gc->nglobals++] = idx;
+	}
+}
+
+/* ownership, see `gc.h` */
+
+// objects outside the heap (literals, the scratch region, memo copies) are never unique.
+void gc_retain_object(void *p) {
+	if (in_arena(p) && HEADER(p)->refs != GC_SHARED)
+		++HEADER(p)->refs;
+}
+
+void gc_release_object(void *p) {
+	if (in_arena(p) && HEADER(p)->refs != GC_SHARED && HEADER(p)->refs)
+		--HEADER(p)->refs;
+}
+
+void gc_see_object(void *p) {
+	if (in_arena(p))
+		HEADER(p)->flags |= SEEN;
+}
+
+void gc_share_object(void *p) {
+	if (in_arena(p))
+		HEADER(p)->refs = GC_SHARED;
+}
+
+bool gc_unique_object(void *p) {
+	return in_arena(p) && HEADER(p)->refs == 1 && !(HEADER(p)->flags & SEEN);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+void dump_gc_stats(FILE *out) {
+	fprintf(out, "gc: %lu minor collections, %zu bytes allocated, %zu promoted, %lu blocks pinned\n",
+		gc->minors, gc->allocated, gc->promoted, gc->pinned);
+	fprintf(out, "gc: %lu major cycles in %lu slices, %zu bytes swept, %lu blocks released\n",
+		gc->cycles, gc->slices, gc->swept, gc->released);
+	fprintf(out, "gc: %.3f ms paused in total, %.3f ms at most\n", gc->pause_total * 1e3, gc->pause_max * 1e3);
+
+	double elapsed = gc->arena ? now() - gc->start : 0;
+	fprintf(out, "gc: %.1f MB/s allocated, old space %.1f%% fragmented after the last sweep\n",
+		elapsed > 0 ? gc->allocated / elapsed / 1e6 : 0, gc->fragmentation * 100);
+	fprintf(out, "gc: slab slots used by size:");
+	for (int c = 0; c < NCLASSES; ++c)
+		fprintf(out, " %d:%lu", class_size[c], gc->slab_allocs[c]);
+	fprintf(out, "\n");
+
+	if (!gc->npauses) return;
+	qsort(gc->pauses, gc->npauses, sizeof(double), compare_doubles);
+	fprintf(out, "gc: pauses p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, p99.9 %.3f ms\n",
+		gc->pauses[gc->npauses / 2] * 1e3, gc->pauses[gc->npauses * 9 / 10] * 1e3,
+		gc->pauses[gc->npauses * 99 / 100] * 1e3, gc->pauses[gc->npauses * 999 / 1000] * 1e3);
+}
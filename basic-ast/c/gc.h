@@ -0,0 +1,107 @@
+#pragma once
+#include "value.h"
+
+// the heap is carved out of one reserved arena, in blocks of GC_BLOCK_SIZE.
+// the nursery is GC_NURSERY_BLOCKS of them; anything bigger than a quarter
+// block is allocated straight into the old space.
+#ifndef GC_BLOCK_SIZE
+#define GC_BLOCK_SIZE (32 << 10)
+#endif
+#ifndef GC_NURSERY_BLOCKS
+#define GC_NURSERY_BLOCKS 64
+#endif
+#ifndef GC_ARENA_SIZE
+#define GC_ARENA_SIZE (8ULL << 30)
+#endif
+// how long (in microseconds) a slice of old space collection may take, see `--gc-budget`.
+#ifndef GC_PAUSE_BUDGET
+#define GC_PAUSE_BUDGET 1000
+#endif
+
+// what a heap object holds, so the collector knows how to trace it.
+enum {
+	GC_STR,    // chars, nothing to trace
+	GC_ARY,    // an `array`, whose `eles` points at a GC_VALUES
+	GC_VALUES, // nothing but `value`s
+	GC_FUNC,   // a `function`, nothing to trace
+	GC_MAP,    // a `hashmap`, whose `slots` point at a GC_VALUES and `ctrl` at a GC_STR
+};
+
+// sits right before every heap object. keeps the object 8-byte aligned.
+typedef struct {
+	unsigned size; // of the object, in bytes
+	unsigned char kind, flags;
+	unsigned short refs; // see `gc_retain`
+} gc_header;
+
+// extra precise roots that live outside the env, e.g. the stack engine's value stack.
+typedef struct gc_roots {
+	value **vals;
+	size_t *len;
+	struct gc_roots *next;
+} gc_roots;
+
+struct env;
+void gc_init(struct env *e, void *stack_base);
+
+// there's one heap to begin with; an embedded interpreter gets its own (see
+// `basicast.c`), and it's whichever's in use on this thread that's allocated
+// from and collected.
+typedef struct heap heap;
+heap *gc_new_heap(void);
+heap *gc_use_heap(heap *h); // returns the one that was in use
+void gc_free_heap(heap *h);
+void *gc_alloc(int kind, size_t size);
+void gc_collect(void);
+
+// one bounded slice of old space collection, if a cycle is due or running.
+extern int gc_pause_budget;
+void gc_slice(void);
+
+// call on loop back-edges, so loops that don't allocate still get slices.
+extern __thread int gc_countdown;
+static inline void gc_safepoint(void) {
+	if (--gc_countdown < 0) gc_slice();
+}
+
+void gc_push_roots(gc_roots *roots);
+void gc_pop_roots(gc_roots *roots);
+gc_roots *gc_top_roots(void); // to pop everything pushed since, with `gc_pop_roots(&(gc_roots) { .next = top })`
+
+// write barriers: call after storing into a heap array or map, or into global number `idx`.
+void gc_array_barrier(array *a);
+void gc_map_barrier(hashmap *m);
+void gc_global_barrier(int idx, value v);
+
+/*
+ * Ownership, so `x = x + y` can grow x's string or array in place when nothing
+ * else could notice. `refs` counts the variables and array slots holding an
+ * object (saturating at GC_SHARED, after which it's shared for good), and an
+ * object is marked "seen" once it's been read out of a variable or been the
+ * value of an assignment, since then some temporary might still hold it. Only
+ * an object with exactly one reference that's never been seen is unique.
+ *
+ * The counts only ever decide ownership; memory is still reclaimed by the gc.
+ */
+#define GC_SHARED 0xFFFF
+#define GC_POINTER(v) (((v) & 5) == 0 && (v) > VTRUE) // strings and arrays
+#define GC_HEADER(p) ((gc_header *) (p) - 1) // only for objects in the heap
+
+// a `gc_header` flag: a string whose unused capacity is all zeros, see `run_extend`.
+#define GC_ZEROED 8
+// and a buffer that `slice` has made views of.
+#define GC_SLICED 64
+
+void gc_retain_object(void *p);
+void gc_release_object(void *p);
+void gc_see_object(void *p);
+void gc_share_object(void *p);
+bool gc_unique_object(void *p);
+
+static inline void gc_retain(value v) { if (GC_POINTER(v)) gc_retain_object((void *) (v & ~7)); }
+static inline void gc_release(value v) { if (GC_POINTER(v)) gc_release_object((void *) (v & ~7)); }
+static inline void gc_see(value v) { if (GC_POINTER(v)) gc_see_object((void *) (v & ~7)); }
+static inline void gc_share(value v) { if (GC_POINTER(v)) gc_share_object((void *) (v & ~7)); }
+static inline bool gc_unique(value v) { return GC_POINTER(v) && gc_unique_object((void *) (v & ~7)); }
+
+void dump_gc_stats(FILE *out);
@@ -0,0 +1,226 @@
+#include "hashmap.h"
+#include "gc.h"
+#include <string.h>
+#ifdef __x86_64__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Maps are swiss tables. Slots come in groups of 16, each with a control byte
+ * that's EMPTY, DELETED, or the low 7 bits of its key's hash. A lookup picks a
+ * group with the rest of the hash and checks all 16 control bytes against those
+ * 7 bits in one SSE2 compare, only looking at the keys that matched; it's over
+ * at the first group with an empty slot. Groups are probed triangularly, which
+ * gets to every one of them, and at most 7/8 of the slots are ever in use
+ * (tombstones included), so there's always an empty one to stop at.
+ *
+ * Each slot's full hash is kept after the control bytes, so a key string is
+ * hashed once, when it goes in: growing doesn't rehash it, and other keys are
+ * only compared with it when their hashes are equal.
+ *
+ * Keys can be ints, strings, booleans or null. Short strings, like ints, are
+ * hashed and compared as the value itself.
+ */
+
+#define GROUP 16
+#define EMPTY 0x80
+#define DELETED 0xFE
+
+static unsigned *hashes(const hashmap *m) {
+	return (unsigned *) (m->ctrl + m->cap);
+}
+
+static bool heap_str(value v) {
+	return (v & 7) == 0 && v > VTRUE;
+}
+
+static unsigned mix(unsigned long long x) {
+	x = (x ^ x >> 33) * 0xff51afd7ed558ccdULL;
+	x = (x ^ x >> 33) * 0xc4ceb9fe1a85ec53ULL;
+	return x ^ x >> 33;
+}
+
+static unsigned hash_key(value k) {
+	switch (classify(k)) {
+	case V_STR:
+		if (is_short_str(k)) return mix(k);
+
+		unsigned long long h = 14695981039346656037ULL;
+		for (const char *s = value2str(k); *s; ++s)
+			h = (h ^ (unsigned char) *s) * 1099511628211ULL;
+		return mix(h);
+
+	case V_INT: case V_BOOL: case V_NULL:
+		return mix(k);
+
+	default:
+		die("map keys must be ints, strings, booleans or null");
+	}
+}
+
+static bool same_key(value a, value b) {
+	return a == b || (heap_str(a) && heap_str(b) && !strcmp(value2str(a), value2str(b)));
+}
+
+#ifdef __x86_64__
+// a bit for each of the group's control bytes that's `b`.
+static unsigned match(const unsigned char *group, unsigned char b) {
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) group), _mm_set1_epi8(b)));
+}
+
+// a bit for each free slot: EMPTY and DELETED are the only control bytes with the top bit set.
+static unsigned match_free(const unsigned char *group) {
+	return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) group));
+}
+#else
+static unsigned match(const unsigned char *group, unsigned char b) {
+	unsigned hits = 0;
+	for (int i = 0; i < GROUP; ++i)
+		hits |= (group[i] == b) << i;
+	return hits;
+}
+
+static unsigned match_free(const unsigned char *group) {
+	unsigned hits = 0;
+	for (int i = 0; i < GROUP; ++i)
+		hits |= (group[i] >> 7) << i;
+	return hits;
+}
+#endif
+
+// the slot holding `k`, whose hash is `h`, or -1.
+static int find(const hashmap *m, value k, unsigned h) {
+	if (!m->cap) return -1;
+
+	unsigned mask = m->cap / GROUP - 1;
+	for (unsigned g = h >> 7 & mask, step = 0;; g = (g + ++step) & mask) {
+		const unsigned char *group = m->ctrl + g * GROUP;
+		for (unsigned hits = match(group, h & 0x7F); hits; hits &= hits - 1) {
+			int i = g * GROUP + __builtin_ctz(hits);
+			if (hashes(m)[i] == h && same_key(m->slots[2 * i], k))
+				return i;
+		}
+		if (match(group, EMPTY)) return -1;
+	}
+}
+
+// where a key hashing to `h` goes, if it isn't in already.
+static int free_slot(const hashmap *m, unsigned h) {
+	unsigned mask = m->cap / GROUP - 1;
+	for (unsigned g = h >> 7 & mask, step = 0;; g = (g + ++step) & mask) {
+		unsigned hits = match_free(m->ctrl + g * GROUP);
+		if (hits) return g * GROUP + __builtin_ctz(hits);
+	}
+}
+
+// moves everything over to a fresh table of `cap` slots, leaving the tombstones behind.
+static void resize(value mv, int cap) {
+	unsigned char *ctrl = gc_alloc(GC_STR, cap * (1 + sizeof(unsigned)));
+	value *slots = gc_alloc(GC_VALUES, 2 * cap * sizeof(value));
+	hashmap *m = value2map(mv), to = { m->len, cap, 0, ctrl, slots };
+	memset(ctrl, EMPTY, cap);
+
+	// read the old table after the allocs, which might've moved it.
+	for (int i = 0; i < m->cap; ++i) {
+		if (m->ctrl[i] & EMPTY) continue;
+
+		unsigned h = hashes(m)[i];
+		int j = free_slot(&to, h);
+		to.ctrl[j] = h & 0x7F;
+		hashes(&to)[j] = h;
+		to.slots[2 * j] = m->slots[2 * i];
+		to.slots[2 * j + 1] = m->slots[2 * i + 1];
+	}
+
+	*m = to;
+	gc_map_barrier(m);
+}
+
+value new_map(int n, const value *kvs) {
+	value m = map2value(gc_alloc(GC_MAP, sizeof(hashmap)));
+	for (int i = 0; i < n; i += 2)
+		map_set(m, kvs[i], kvs[i + 1]);
+	return m;
+}
+
+value map_get(value mv, value k) {
+	hashmap *m = value2map(mv);
+	int i = find(m, k, hash_key(k));
+	return i < 0 ? VNULL : m->slots[2 * i + 1];
+}
+
+bool map_has(value mv, value k) {
+	return find(value2map(mv), k, hash_key(k)) >= 0;
+}
+
+void map_set(value mv, value k, value v) {
+	unsigned h = hash_key(k);
+	hashmap *m = value2map(mv);
+	int i = find(m, k, h);
+
+	if (i < 0) {
+		if ((m->len + m->deleted + 1) * 8 > m->cap * 7) // full enough: grow, or just clear out the tombstones
+			resize(mv, !m->cap ? GROUP : (m->len + 1) * 2 > m->cap ? m->cap * 2 : m->cap);
+
+		i = free_slot(m, h);
+		if (m->ctrl[i] == DELETED) --m->deleted;
+		m->ctrl[i] = h & 0x7F;
+		hashes(m)[i] = h;
+		gc_retain(m->slots[2 * i] = k);
+		m->slots[2 * i + 1] = VNULL;
+		++m->len;
+	}
+
+	gc_retain(v);
+	gc_release(m->slots[2 * i + 1]);
+	m->slots[2 * i + 1] = v;
+	gc_map_barrier(m);
+}
+
+bool map_delete(value mv, value k) {
+	hashmap *m = value2map(mv);
+	int i = find(m, k, hash_key(k));
+	if (i < 0) return false;
+
+	// a lookup never gets past a group with an empty slot, so then nothing needs a tombstone here.
+	if (match(m->ctrl + i / GROUP * GROUP, EMPTY)) {
+		m->ctrl[i] = EMPTY;
+	} else {
+		m->ctrl[i] = DELETED;
+		++m->deleted;
+	}
+
+	gc_release(m->slots[2 * i]);
+	gc_release(m->slots[2 * i + 1]);
+	m->slots[2 * i] = m->slots[2 * i + 1] = VNULL;
+	--m->len;
+	return true;
+}
+
+// goes through the entries, in no particular order: starting with i = 0, each
+// call puts the next one in *k and *v, and returns the i to pass next, or 0 at the end.
+int map_next(value mv, int i, value *k, value *v) {
+	hashmap *m = value2map(mv);
+	for (; i < m->cap; ++i) {
+		if (m->ctrl[i] & EMPTY) continue;
+		*k = m->slots[2 * i];
+		*v = m->slots[2 * i + 1];
+		return i + 1;
+	}
+	return 0;
+}
+
+// the keys, in no particular order.
+value map_keys(value mv) {
+	int len = value2map(mv)->len;
+	value *buf = gc_alloc(GC_VALUES, len * sizeof(value)); // first, see `make_array`
+	array *a = gc_alloc(GC_ARY, sizeof(array));
+	hashmap *m = value2map(mv);
+
+	for (int i = 0, n = 0; i < m->cap; ++i)
+		if (!(m->ctrl[i] & EMPTY))
+			gc_retain(buf[n++] = m->slots[2 * i]);
+	a->eles = buf;
+	a->cap = a->len = len;
+	return ary2value(a);
+}
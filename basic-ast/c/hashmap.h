@@ -0,0 +1,11 @@
+#pragma once
+#include "value.h"
+
+// maps, `{key: value, ...}`, see `hashmap.c`.
+value new_map(int n, const value *kvs); // n is twice the number of pairs in kvs
+value map_get(value m, value k);
+void map_set(value m, value k, value v);
+bool map_has(value m, value k);
+bool map_delete(value m, value k);
+value map_keys(value m);
+int map_next(value m, int i, value *k, value *v);
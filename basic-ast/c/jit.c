@@ -0,0 +1,572 @@
+#include "jit.h"
+#include "run.h"
+#include "shared.h"
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Baseline x86-64 JIT. Each function is compiled in a single pass straight
+ * from the AST: expression results live in `rax`, temporaries get pushed onto
+ * the native stack, and locals live in fixed slots below `rbp`. `rbx` holds the
+ * env for the whole function.
+ *
+ * Values stay tagged the whole way through. Integer `+ - * < > <= >= == !=`
+ * get an inline fast path behind a tag check; everything else (and the fast
+ * paths' slow cases) just calls back into the interpreter's runtime, so
+ * semantics are identical to `run.c`.
+ *
+ * Compiled functions are `value f(value *argv, env *e)`, and are called through
+ * `function.native` by `call_value`.
+ */
+
+int jit_threshold = JIT_THRESHOLD;
+
+typedef struct {
+	unsigned char *code;
+	int len, cap;
+
+	int depth; // how many temporaries are currently pushed, to keep calls 16-byte aligned
+	int nlocals;
+	char **locals;
+
+	struct loop { int top, nbreaks, breaks[64]; } *loop;
+	env *e;
+	bool failed;
+} jit;
+
+static void emit(jit *j, const char *bytes, int len) {
+	if (j->len + len > j->cap)
+		j->code = realloc(j->code, j->cap = j->cap * 2 + len);
+	memcpy(j->code + j->len, bytes, len);
+	j->len += len;
+}
+
+#define EMIT(j, bytes) emit(j, bytes, sizeof(bytes) - 1)
+static void emit32(jit *j, int32_t i) { emit(j, (char *) &i, 4); }
+static void emit64(jit *j, int64_t i) { emit(j, (char *) &i, 8); }
+
+// emits a `jcc`/`jmp` with a rel32 to be patched later, returns where the rel32 is.
+static int emit_jump(jit *j, const char *op, int oplen) {
+	emit(j, op, oplen);
+	emit32(j, 0);
+	return j->len - 4;
+}
+#define JMP(j) emit_jump(j, "\xE9", 1)
+#define JBE(j) emit_jump(j, "\x0F\x86", 2)
+#define JNE(j) emit_jump(j, "\x0F\x85", 2)
+
+static void patch(jit *j, int at, int target) {
+	int32_t rel = target - (at + 4);
+	memcpy(j->code + at, &rel, 4);
+}
+
+static void call(jit *j, const void *fn);
+
+// loops that don't allocate still have to give the gc its slices, like `run_block`'s.
+static void jit_safepoint(void) {
+	gc_safepoint();
+}
+
+static void jump_back(jit *j, int target) {
+	call(j, jit_safepoint);
+	patch(j, JMP(j), target);
+}
+
+static void push_rax(jit *j) { EMIT(j, "\x50"); ++j->depth; }
+static void pop_rax(jit *j) { EMIT(j, "\x58"); --j->depth; }
+
+static void mov_rax_imm(jit *j, value v) { EMIT(j, "\x48\xB8"); emit64(j, v); }
+static void mov_rdi_imm(jit *j, const void *p) { EMIT(j, "\x48\xBF"); emit64(j, (int64_t) p); }
+static void mov_rsi_imm(jit *j, const void *p) { EMIT(j, "\x48\xBE"); emit64(j, (int64_t) p); }
+
+static void reserve(jit *j, int slots) {
+	if (!slots) return;
+	EMIT(j, "\x48\x81\xEC"); emit32(j, slots * 8); // sub rsp, slots*8
+	j->depth += slots;
+}
+
+static void release(jit *j, int slots) {
+	if (!slots) return;
+	EMIT(j, "\x48\x81\xC4"); emit32(j, slots * 8); // add rsp, slots*8
+	j->depth -= slots;
+}
+
+static void store_rsp(jit *j, int slot) {
+	EMIT(j, "\x48\x89\x84\x24"); emit32(j, slot * 8); // mov [rsp+slot*8], rax
+}
+
+static void call(jit *j, const void *fn) {
+	bool pad = j->depth & 1;
+	if (pad) EMIT(j, "\x48\x83\xEC\x08"); // sub rsp, 8
+	EMIT(j, "\x49\xBB"); emit64(j, (int64_t) fn); // mov r11, fn
+	EMIT(j, "\x41\xFF\xD3"); // call r11
+	if (pad) EMIT(j, "\x48\x83\xC4\x08"); // add rsp, 8
+}
+
+static void epilogue(jit *j) {
+	EMIT(j, "\x48\x8B\x5D\xF8"); // mov rbx, [rbp-8]
+	EMIT(j, "\xC9\xC3"); // leave; ret
+}
+
+// jumps to the returned patch location unless both `rax` and `rcx` are ints.
+static int guard_ints(jit *j) {
+	EMIT(j, "\x89\xC2\x83\xE2\x07\x83\xFA\x04"); // mov edx, eax; and edx, 7; cmp edx, 4
+	int first = JNE(j);
+	EMIT(j, "\x89\xCA\x83\xE2\x07\x83\xFA\x04"); // mov edx, ecx; and edx, 7; cmp edx, 4
+	int second = JNE(j);
+	patch(j, first, j->len - 6); // just reuse the second `jne`.
+	return second;
+}
+
+static int local_slot(jit *j, const char *name) {
+	for (int i = 0; i < j->nlocals; ++i)
+		if (!strcmp(j->locals[i], name))
+			return i;
+	return -1;
+}
+
+static int32_t slot_disp(int slot) {
+	return -16 - 8 * slot;
+}
+
+// runtime helpers the generated code calls into.
+static value jit_lookup(env *e, const char *name) {
+	value v = lookup_var(e, name);
+	if (v == VUNDEF) die("undefined variable '%s' accessed", name);
+	return v;
+}
+
+static void jit_undefined(const char *name) {
+	die("undefined variable '%s' accessed", name);
+}
+
+static void compile_expression(jit *j, ast_expression *expr);
+
+// evaluates `exprs` into `len` freshly reserved slots at `rsp`, returns how many slots were reserved.
+static int compile_args(jit *j, int len, ast_expression **exprs) {
+	int slots = (len + 1) & ~1;
+	reserve(j, slots);
+	for (int i = 0; i < len; ++i) {
+		compile_expression(j, exprs[i]);
+		store_rsp(j, i);
+	}
+	return slots;
+}
+
+static void compile_primary(jit *j, ast_primary *prim) {
+	int slot, skip;
+
+	switch (prim->kind) {
+	case AST_PAREN:
+		compile_expression(j, prim->expr);
+		break;
+
+	case AST_INDEX:
+		compile_primary(j, prim->prim);
+		push_rax(j);
+		compile_expression(j, prim->expr);
+		EMIT(j, "\x48\x89\xC6"); // mov rsi, rax
+		EMIT(j, "\x5F"); --j->depth; // pop rdi
+		call(j, index_into);
+		break;
+
+	case AST_FNCALL:;
+		int builtin = prim->prim->kind == AST_VAR ? builtin_kind(prim->prim->ident) : 0;
+		if (!builtin) {
+			compile_primary(j, prim->prim);
+			push_rax(j);
+		}
+
+		int slots = compile_args(j, prim->amnt, prim->args);
+		EMIT(j, "\xBE"); emit32(j, prim->amnt); // mov esi, amnt
+		EMIT(j, "\x48\x89\xE2"); // mov rdx, rsp
+		EMIT(j, "\x48\x89\xD9"); // mov rcx, rbx
+
+		if (builtin) {
+			EMIT(j, "\xBF"); emit32(j, builtin); // mov edi, builtin
+			call(j, run_builtin);
+			release(j, slots);
+		} else {
+			EMIT(j, "\x48\x8B\xBC\x24"); emit32(j, slots * 8); // mov rdi, [rsp+slots*8]
+			call(j, call_value);
+			release(j, slots + 1);
+		}
+		break;
+
+	case AST_NEG:
+		compile_primary(j, prim->prim);
+		EMIT(j, "\x89\xC2\x83\xE2\x07\x83\xFA\x04"); // mov edx, eax; and edx, 7; cmp edx, 4
+		int slow = JNE(j);
+		EMIT(j, "\x48\xC7\xC1\x08\x00\x00\x00"); // mov rcx, 8
+		EMIT(j, "\x48\x29\xC1\x48\x89\xC8"); // sub rcx, rax; mov rax, rcx
+		skip = JMP(j);
+		patch(j, slow, j->len);
+		EMIT(j, "\x48\x89\xC7"); // mov rdi, rax
+		call(j, run_neg);
+		patch(j, skip, j->len);
+		break;
+
+	case AST_NOT:
+		compile_primary(j, prim->prim);
+		EMIT(j, "\x48\x89\xC7"); // mov rdi, rax
+		call(j, run_not);
+		break;
+
+	case AST_ARY:
+	case AST_MAP:;
+		int aslots = compile_args(j, prim->amnt, prim->args);
+		EMIT(j, "\xBF"); emit32(j, prim->amnt); // mov edi, amnt
+		EMIT(j, "\x48\x89\xE6"); // mov rsi, rsp
+		if (prim->kind == AST_ARY) call(j, new_array);
+		else call(j, new_map);
+		release(j, aslots);
+		break;
+
+	case AST_VAR:
+		if ((slot = local_slot(j, prim->ident)) < 0) {
+			EMIT(j, "\x48\x89\xDF"); // mov rdi, rbx
+			mov_rsi_imm(j, prim->ident);
+			call(j, jit_lookup);
+			break;
+		}
+
+		EMIT(j, "\x48\x8B\x85"); emit32(j, slot_disp(slot)); // mov rax, [rbp+disp]
+		EMIT(j, "\x48\x83\xF8\x03"); // cmp rax, VUNDEF
+		skip = JNE(j);
+		mov_rdi_imm(j, prim->ident);
+		call(j, jit_undefined);
+		patch(j, skip, j->len);
+		break;
+
+	case AST_LITERAL:
+		mov_rax_imm(j, prim->value);
+		break;
+
+	default:
+		j->failed = true;
+	}
+}
+
+static void compile_binop(jit *j, token_kind op) {
+	int slow = -1, done = -1;
+
+	// rax = lhs, rcx = rhs
+	switch (op) {
+	case TK_ADD:
+		slow = guard_ints(j);
+		EMIT(j, "\x48\x01\xC8\x48\x83\xE8\x04"); // add rax, rcx; sub rax, 4
+		break;
+
+	case TK_SUB:
+		slow = guard_ints(j);
+		EMIT(j, "\x48\x29\xC8\x48\x83\xC0\x04"); // sub rax, rcx; add rax, 4
+		break;
+
+	case TK_MUL:
+		slow = guard_ints(j);
+		EMIT(j, "\x48\x89\xCA\x48\x83\xEA\x04"); // mov rdx, rcx; sub rdx, 4
+		EMIT(j, "\x48\xC1\xF8\x03"); // sar rax, 3
+		EMIT(j, "\x48\x0F\xAF\xC2\x48\x83\xC0\x04"); // imul rax, rdx; add rax, 4
+		break;
+
+	case TK_LTH: case TK_GTH: case TK_LEQ: case TK_GEQ: case TK_EQL: case TK_NEQ:
+		slow = guard_ints(j);
+		EMIT(j, "\x48\x39\xC8"); // cmp rax, rcx
+		switch (op) {
+		case TK_LTH: EMIT(j, "\x0F\x9C\xC0"); break; // setl al
+		case TK_GTH: EMIT(j, "\x0F\x9F\xC0"); break; // setg al
+		case TK_LEQ: EMIT(j, "\x0F\x9E\xC0"); break; // setle al
+		case TK_GEQ: EMIT(j, "\x0F\x9D\xC0"); break; // setge al
+		case TK_EQL: EMIT(j, "\x0F\x94\xC0"); break; // sete al
+		default:     EMIT(j, "\x0F\x95\xC0"); break; // setne al
+		}
+		EMIT(j, "\x0F\xB6\xC0\x01\xC0"); // movzx eax, al; add eax, eax (so VTRUE or VFALSE)
+		break;
+
+	default:
+		break; // no fast path, always go through `run_binop`.
+	}
+
+	if (slow >= 0) {
+		done = JMP(j);
+		patch(j, slow, j->len);
+	}
+
+	EMIT(j, "\x48\x89\xCA\x48\x89\xC6"); // mov rdx, rcx; mov rsi, rax
+	EMIT(j, "\xBF"); emit32(j, op); // mov edi, op
+	EMIT(j, "\x31\xC9\x49\x89\xD8"); // xor ecx, ecx; mov r8, rbx
+	call(j, run_binop);
+
+	if (done >= 0)
+		patch(j, done, j->len);
+}
+
+static void compile_expression(jit *j, ast_expression *expr) {
+	int slot;
+
+	switch (expr->kind) {
+	case AST_ASSIGN:
+	case AST_INCR:
+	case AST_EXTEND:
+		compile_expression(j, expr->rhs);
+		if ((slot = local_slot(j, expr->name)) >= 0) {
+			EMIT(j, "\x48\x89\x85"); emit32(j, slot_disp(slot)); // mov [rbp+disp], rax
+			break;
+		}
+
+		push_rax(j);
+		EMIT(j, "\x48\x89\xC2\x48\x89\xDF"); // mov rdx, rax; mov rdi, rbx
+		mov_rsi_imm(j, expr->name);
+		call(j, assign_var);
+		pop_rax(j);
+		break;
+
+	case AST_IDX_ASSIGN:
+	case AST_APPEND:
+		compile_primary(j, expr->prim);
+		push_rax(j);
+		compile_expression(j, expr->index);
+		push_rax(j);
+		compile_expression(j, expr->rhs);
+		push_rax(j);
+		EMIT(j, "\x48\x89\xC2"); // mov rdx, rax
+		EMIT(j, "\x48\x8B\x74\x24\x08\x48\x8B\x7C\x24\x10"); // mov rsi, [rsp+8]; mov rdi, [rsp+16]
+		call(j, index_assign);
+		pop_rax(j);
+		release(j, 2);
+		break;
+
+	case AST_BINOP:
+	case AST_LTH_LENGTH:
+		compile_primary(j, expr->prim);
+		push_rax(j);
+		compile_expression(j, expr->rhs);
+		EMIT(j, "\x48\x89\xC1"); // mov rcx, rax
+		pop_rax(j);
+		compile_binop(j, expr->binop);
+		break;
+
+	case AST_PRIM:
+		compile_primary(j, expr->prim);
+		break;
+
+	default:
+		j->failed = true;
+	}
+}
+
+static void compile_block(jit *j, ast_block *block) {
+	for (int i = 0; i < block->amnt && !j->failed; ++i) {
+		ast_statement *s = block->stmts[i];
+		int skip, end;
+
+		switch (s->kind) {
+		case AST_RETURN:
+			if (s->expr) compile_expression(j, s->expr);
+			else mov_rax_imm(j, VNULL);
+			epilogue(j);
+			break;
+
+		case AST_IF:
+			compile_expression(j, s->expr);
+			EMIT(j, "\x48\x83\xF8\x01"); // cmp rax, 1 (ie VNULL or VFALSE)
+			skip = JBE(j);
+			compile_block(j, s->body);
+			if (s->else_body) {
+				end = JMP(j);
+				patch(j, skip, j->len);
+				compile_block(j, s->else_body);
+				patch(j, end, j->len);
+			} else {
+				patch(j, skip, j->len);
+			}
+			break;
+
+		case AST_WHILE:;
+			struct loop loop = { .top = j->len }, *outer = j->loop;
+			compile_expression(j, s->expr);
+			EMIT(j, "\x48\x83\xF8\x01"); // cmp rax, 1
+			int exit = JBE(j);
+
+			j->loop = &loop;
+			compile_block(j, s->body);
+			j->loop = outer;
+
+			jump_back(j, loop.top);
+			patch(j, exit, j->len);
+			for (int k = 0; k < loop.nbreaks; ++k)
+				patch(j, loop.breaks[k], j->len);
+			break;
+
+		case AST_BREAK:
+		case AST_CONTINUE:
+			// outside of a loop, `run_block` just bails out of the function.
+			if (!j->loop) {
+				mov_rax_imm(j, VNULL);
+				epilogue(j);
+			} else if (s->kind == AST_CONTINUE) {
+				jump_back(j, j->loop->top);
+			} else if (j->loop->nbreaks == sizeof(j->loop->breaks) / sizeof(int)) {
+				j->failed = true;
+			} else {
+				j->loop->breaks[j->loop->nbreaks++] = JMP(j);
+			}
+			break;
+
+		case AST_EXPR:
+			compile_expression(j, s->expr);
+			break;
+
+		default:
+			j->failed = true;
+		}
+	}
+}
+
+static bool is_global(env *e, const char *name) {
+	for (int i = 0; i < e->globals.len; ++i)
+		if (!strcmp(e->globals.entries[i].name, name))
+			return true;
+	return false;
+}
+
+static void add_local(jit *j, char *name) {
+	if (is_global(j->e, name) || local_slot(j, name) >= 0)
+		return;
+	j->locals = realloc(j->locals, (j->nlocals + 1) * sizeof(char *));
+	j->locals[j->nlocals++] = name;
+}
+
+// anything assigned to that isn't a global is a local, exactly like `assign_var`.
+static void collect_expression(jit *j, ast_expression *expr);
+static void collect_primary(jit *j, ast_primary *prim) {
+	switch (prim->kind) {
+	case AST_PAREN:
+		collect_expression(j, prim->expr);
+		break;
+	case AST_INDEX:
+		collect_expression(j, prim->expr);
+		// fallthru
+	case AST_NEG:
+	case AST_NOT:
+		collect_primary(j, prim->prim);
+		break;
+	case AST_FNCALL:
+		collect_primary(j, prim->prim);
+		// fallthru
+	case AST_ARY:
+	case AST_MAP:
+		for (int i = 0; i < prim->amnt; ++i)
+			collect_expression(j, prim->args[i]);
+		break;
+	default:
+		break;
+	}
+}
+
+static void collect_expression(jit *j, ast_expression *expr) {
+	switch (expr->kind) {
+	case AST_ASSIGN:
+	case AST_INCR:
+	case AST_EXTEND:
+		add_local(j, expr->name);
+		break;
+	case AST_IDX_ASSIGN:
+	case AST_APPEND:
+		collect_expression(j, expr->index);
+		// fallthru
+	case AST_BINOP:
+	case AST_LTH_LENGTH:
+		collect_primary(j, expr->prim);
+		break;
+	case AST_PRIM:
+		collect_primary(j, expr->prim);
+		return;
+	default:
+		return;
+	}
+	collect_expression(j, expr->rhs);
+}
+
+static void collect_locals(jit *j, ast_block *block) {
+	for (int i = 0; i < block->amnt; ++i) {
+		ast_statement *s = block->stmts[i];
+		switch (s->kind) {
+		case AST_IF:
+			if (s->else_body) collect_locals(j, s->else_body);
+			// fallthru
+		case AST_WHILE:
+			collect_locals(j, s->body);
+			// fallthru
+		case AST_EXPR:
+		case AST_RETURN:
+			if (s->expr) collect_expression(j, s->expr);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+void jit_compile(function *f, env *e) {
+	jit j = { .e = e };
+
+	// args that shadow globals get assigned to the global by `call_value`; not worth it.
+	for (int i = 0; i < f->argc; ++i) {
+		if (is_global(e, f->argv[i])) goto fail;
+		add_local(&j, f->argv[i]);
+	}
+
+	collect_locals(&j, f->block);
+
+	// prologue: push rbp; mov rbp, rsp; push rbx; mov rbx, rsi; sub rsp, frame
+	int frame = 8 * j.nlocals;
+	if (frame % 16 != 8) frame += 8;
+	EMIT(&j, "\x55\x48\x89\xE5\x53\x48\x89\xF3\x48\x81\xEC"); emit32(&j, frame);
+
+	for (int i = 0; i < j.nlocals; ++i) {
+		if (i < f->argc) {
+			EMIT(&j, "\x48\x8B\x87"); emit32(&j, i * 8); // mov rax, [rdi+i*8]
+		} else {
+			mov_rax_imm(&j, VUNDEF);
+		}
+		EMIT(&j, "\x48\x89\x85"); emit32(&j, slot_disp(i)); // mov [rbp+disp], rax
+	}
+
+	compile_block(&j, f->block);
+	mov_rax_imm(&j, VNULL);
+	epilogue(&j);
+
+	if (j.failed) goto fail;
+
+	size_t page = sysconf(_SC_PAGESIZE), size = (j.len + page - 1) / page * page;
+	void *code = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED) goto fail;
+
+	memcpy(code, j.code, j.len);
+	if (mprotect(code, size, PROT_READ | PROT_EXEC)) {
+		munmap(code, size);
+		goto fail;
+	}
+
+	f->native = (value (*)(value *, env *)) code;
+	f->native_size = size;
+	free(j.code);
+	free(j.locals);
+	return;
+
+fail:
+	f->heat = INT_MIN; // don't bother trying again.
+	free(j.code);
+	free(j.locals);
+}
+
+void jit_free(function *f) {
+	if (!f->native_size) return;
+	munmap((void *) f->native, f->native_size);
+	f->native = 0;
+	f->native_size = 0;
+}
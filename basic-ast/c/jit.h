@@ -0,0 +1,14 @@
+#pragma once
+#include "value.h"
+
+// how many calls plus loop back-edges a function gets before it's compiled.
+// can be overridden at runtime with `BASICAST_JIT_THRESHOLD`.
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 100
+#endif
+
+extern int jit_threshold;
+
+struct env;
+void jit_compile(function *f, struct env *e);
+void jit_free(function *f); // unmaps f's compiled code, for when f's going away
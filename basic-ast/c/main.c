@@ -1,13 +1,56 @@
 #include "token.h"
-#include "ast.h"
-#include "env.h"
+#include "run.h"
+#include "memo.h"
+#include "out.h"
+#include "file.h"
+#include "serve.h"
 #include "shared.h"
+#include <string.h>
+#include <unistd.h>
+#ifdef BASICAST_JIT
+#include "jit.h"
+#endif
 
 env e;
-void run_declaration(ast_declaration*, env*);
+void emit_c(FILE *out, ast_declaration **decls, int ndecls);
+
+// `--emit-c` prints a standalone C version of the program instead of running it.
+static void emit_program(tokenizer *tzr) {
+	int len = 0, cap = 16;
+	ast_declaration **decls = malloc(cap * sizeof(ast_declaration *));
+
+	while ((decls[len] = next_declaration(tzr)))
+		if (++len == cap)
+			decls = realloc(decls, (cap *= 2) * sizeof(ast_declaration *));
+
+	emit_c(stdout, decls, len);
+}
+
 int main(int argc, char **argv) {
+	bool emit = false, stats = false, records = false;
+	char *serve_path = 0;
+	int i, workers = 0;
+	for (i = 1; i < argc - 1; ++i) {
+		if (!strcmp(argv[i], "--emit-c")) emit = true;
+		else if (!strcmp(argv[i], "--stats")) stats = true;
+		else if (!strcmp(argv[i], "--engine=tree")) engine = ENGINE_TREE;
+		else if (!strcmp(argv[i], "--engine=closure")) engine = ENGINE_CLOSURE;
+		else if (!strcmp(argv[i], "--engine=stack")) engine = ENGINE_STACK;
+		else if (!strncmp(argv[i], "--max-depth=", 12)) stackframe_limit = atoi(argv[i] + 12);
+		else if (!strncmp(argv[i], "--gc-budget=", 12)) gc_pause_budget = atoi(argv[i] + 12);
+		else if (!strcmp(argv[i], "--line-buffered")) out_line_buffered = true;
+		else if (!strcmp(argv[i], "-n")) records = true;
+		else if (!strncmp(argv[i], "--serve=", 8)) serve_path = argv[i] + 8;
+		else if (!strncmp(argv[i], "--workers=", 10)) workers = atoi(argv[i] + 10);
+		else break;
+	}
+	// only a server can load more than one program.
+	if (i == argc || (i != argc - 1 && !serve_path))
+		die("usage: %s [--emit-c] [--stats] [--engine=tree|closure|stack] [--max-depth=N] [--gc-budget=US] [--line-buffered] [-n] <program>\n"
+			"       %s --serve=SOCKET [--workers=N] [options] <program>...\n", argv[0], argv[0]);
+
 	// tokenizer tzr = new_tokenizer("function main() { b = 0; }");
-	tokenizer tzr = new_tokenizer(argv[1]);
+	tokenizer tzr = new_tokenizer(argv[i]);
 	// tokenizer tzr = new_tokenizer("\
 	// 	function foo() { x = 2; return 4; } \n\
 	// 	function main1(){ x = 3; print(\"hi\" + (''+foo()) + \"\n\"); print(\"\"+x); } \n\
@@ -18,12 +61,49 @@ int main(int argc, char **argv) {
 	// 		# while i < 3 { print('' + ary[i]); i = i+1; } \n\
 	// 	}");
 
+#ifdef BASICAST_JIT
+	char *threshold = getenv("BASICAST_JIT_THRESHOLD");
+	if (threshold) jit_threshold = atoi(threshold);
+#endif
+
+	if (emit) {
+		emit_program(&tzr);
+		return 0;
+	}
+
+	gc_init(&e, __builtin_frame_address(0));
+
 	ast_declaration *d;
 	while ((d = next_declaration(&tzr)))
 		run_declaration(d, &e);
+	while (++i < argc) {
+		tzr = new_tokenizer(argv[i]);
+		while ((d = next_declaration(&tzr)))
+			run_declaration(d, &e);
+	}
+	analyze_purity(&e);
 
 	value v;
-	if ((v = lookup_var(&e, "main")) == VUNDEF)
-		die("you must define a `main` function");
-	call_value(v, 0, 0, &e);
+	if (serve_path) {
+		serve(serve_path, workers, &e);
+	} else if (records) {
+		// `-n`: the program's `process(line)` gets each line of stdin, between `begin()` and `end()` if it has them.
+		value process = lookup_var(&e, "process");
+		if (process == VUNDEF || classify(process) != V_FUNC || value2func(process)->argc != 1)
+			die("-n needs a `process(line)` function");
+
+		if ((v = lookup_var(&e, "begin")) != VUNDEF) call_value(v, 0, 0, &e);
+		process_records(STDIN_FILENO, process, &e);
+		if ((v = lookup_var(&e, "end")) != VUNDEF) call_value(v, 0, 0, &e);
+	} else {
+		if ((v = lookup_var(&e, "main")) == VUNDEF)
+			die("you must define a `main` function");
+		call_value(v, 0, 0, &e);
+	}
+
+	// `--stats` reports how often the fused fast paths got used.
+	if (stats) {
+		dump_fusion_stats(stderr);
+		dump_gc_stats(stderr);
+	}
 }
@@ -0,0 +1,169 @@
+#include "memo.h"
+#include "gc.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Per-function result cache: a chained hash table keyed on the argument values,
+ * with an intrusive LRU list threaded through the entries so the oldest one can
+ * be evicted once the cache is full.
+ *
+ * Only ints, strings, booleans and null are used as keys or cached as results;
+ * arrays and functions have identity, so calls involving them always run.
+ */
+
+typedef struct memo_entry {
+	struct memo_entry *chain, *newer, *older;
+	unsigned long hash;
+	value result;
+	int argc;
+	value argv[];
+} memo_entry;
+
+struct memo {
+	int len, capacity;
+	size_t nbuckets;
+	memo_entry **buckets, *newest, *oldest;
+	struct memo *next;
+};
+
+static __thread memo *memos; // all of this thread's, so the gc can find what they hold
+
+static bool is_cacheable(value v) {
+	switch (classify(v)) {
+	case V_INT: case V_STR: case V_BOOL: case V_NULL: return true;
+	default: return false;
+	}
+}
+
+static unsigned long hash_args(int argc, const value *argv) {
+	unsigned long hash = 14695981039346656037UL;
+
+	for (int i = 0; i < argc; ++i) {
+		if (classify(argv[i]) == V_STR && !is_short_str(argv[i]))
+			for (const char *s = value2str(argv[i]); *s; ++s)
+				hash = (hash ^ (unsigned char) *s) * 1099511628211UL;
+		else
+			hash = (hash ^ argv[i]) * 1099511628211UL;
+		hash = (hash ^ classify(argv[i])) * 1099511628211UL;
+	}
+
+	return hash;
+}
+
+static bool same_args(const memo_entry *entry, int argc, const value *argv) {
+	if (entry->argc != argc)
+		return false;
+
+	for (int i = 0; i < argc; ++i) {
+		if (entry->argv[i] == argv[i]) continue;
+		if (classify(argv[i]) != V_STR || classify(entry->argv[i]) != V_STR) return false;
+		if (is_short_str(argv[i]) || is_short_str(entry->argv[i])) return false;
+		if (strcmp(value2str(entry->argv[i]), value2str(argv[i]))) return false;
+	}
+
+	return true;
+}
+
+memo *new_memo(int capacity) {
+	memo *m = calloc(1, sizeof(memo));
+	m->capacity = capacity;
+	for (m->nbuckets = 16; m->nbuckets < (size_t) capacity && m->nbuckets < MEMO_MAX_CAPACITY; m->nbuckets *= 2);
+	m->buckets = calloc(m->nbuckets, sizeof(memo_entry *));
+	m->next = memos;
+	return memos = m;
+}
+
+void free_memo(memo *m) {
+	memo **link = &memos;
+	while (*link != m)
+		link = &(*link)->next;
+	*link = m->next;
+
+	for (memo_entry *entry = m->newest, *older; entry; entry = older) {
+		older = entry->older;
+		free(entry);
+	}
+
+	free(m->buckets);
+	free(m);
+}
+
+static void unlink_lru(memo *m, memo_entry *entry) {
+	if (entry->newer) entry->newer->older = entry->older;
+	else m->newest = entry->older;
+	if (entry->older) entry->older->newer = entry->newer;
+	else m->oldest = entry->newer;
+}
+
+static void push_lru(memo *m, memo_entry *entry) {
+	entry->newer = 0;
+	entry->older = m->newest;
+	if (m->newest) m->newest->newer = entry;
+	else m->oldest = entry;
+	m->newest = entry;
+}
+
+bool memo_lookup(memo *m, int argc, const value *argv, value *result) {
+	for (int i = 0; i < argc; ++i)
+		if (!is_cacheable(argv[i]))
+			return false;
+
+	unsigned long hash = hash_args(argc, argv);
+	for (memo_entry *entry = m->buckets[hash & (m->nbuckets - 1)]; entry; entry = entry->chain) {
+		if (entry->hash != hash || !same_args(entry, argc, argv))
+			continue;
+
+		unlink_lru(m, entry);
+		push_lru(m, entry);
+		*result = entry->result;
+		return true;
+	}
+
+	return false;
+}
+
+void memo_insert(memo *m, int argc, const value *argv, value result) {
+	if (!m->capacity || !is_cacheable(result))
+		return;
+
+	for (int i = 0; i < argc; ++i)
+		if (!is_cacheable(argv[i]))
+			return;
+
+	if (m->len == m->capacity) {
+		memo_entry *victim = m->oldest, **link = &m->buckets[victim->hash & (m->nbuckets - 1)];
+		while (*link != victim)
+			link = &(*link)->chain;
+		*link = victim->chain;
+		unlink_lru(m, victim);
+		free(victim);
+		--m->len;
+	}
+
+	// anything we keep could be handed out again later, so it's never uniquely owned.
+	gc_share(result);
+	for (int i = 0; i < argc; ++i)
+		gc_share(argv[i]);
+
+	memo_entry *entry = malloc(sizeof(memo_entry) + argc * sizeof(value));
+	entry->hash = hash_args(argc, argv);
+	entry->result = result;
+	entry->argc = argc;
+	memcpy(entry->argv, argv, argc * sizeof(value));
+
+	memo_entry **bucket = &m->buckets[entry->hash & (m->nbuckets - 1)];
+	entry->chain = *bucket;
+	*bucket = entry;
+	push_lru(m, entry);
+	++m->len;
+}
+
+void memo_visit_roots(void (*visit)(value *)) {
+	for (memo *m = memos; m; m = m->next)
+		for (memo_entry *entry = m->newest; entry; entry = entry->older) {
+			for (int i = 0; i < entry->argc; ++i)
+				visit(&entry->argv[i]);
+			visit(&entry->result);
+		}
+}
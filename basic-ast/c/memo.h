@@ -0,0 +1,21 @@
+#pragma once
+#include "value.h"
+
+// default number of results cached per pure function; `memoize(f, n)` changes it.
+#ifndef MEMO_CAPACITY
+#define MEMO_CAPACITY 4096
+#endif
+
+// the biggest cache `memoize(f, n)` will make, in entries.
+#define MEMO_MAX_CAPACITY (1 << 24)
+
+typedef struct memo memo;
+
+memo *new_memo(int capacity);
+void free_memo(memo *m);
+bool memo_lookup(memo *m, int argc, const value *argv, value *result);
+void memo_insert(memo *m, int argc, const value *argv, value result);
+void memo_visit_roots(void (*visit)(value *)); // every key and result in every memo, for the gc
+
+struct env;
+void analyze_purity(struct env *e);
@@ -0,0 +1,104 @@
+#include "out.h"
+#include "shared.h"
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+/*
+ * `print` doesn't go through stdio: lines are copied straight into one big
+ * buffer (ints formatted by `format_int`, no format strings), which is written
+ * out when it's full and at exit. A string too long to be worth copying is written
+ * from where it is instead, along with whatever's buffered before it and its
+ * newline, in one `writev`.
+ *
+ * Output to a terminal, or with `--line-buffered`, is flushed after every line.
+ *
+ * The buffer's shared by every thread (see `basicast.h`), under a lock, so
+ * lines from different threads are never mixed up.
+ */
+
+#define OUT_BUFFER_SIZE (64 << 10)
+#define OUT_DIRECT 4096 // strings at least this long aren't copied
+
+bool out_line_buffered;
+static char buf[OUT_BUFFER_SIZE];
+static size_t used;
+static bool started;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // held by everything below that writes
+
+static void write_all(struct iovec *iov, int n) {
+	while (n) {
+		ssize_t written = writev(STDOUT_FILENO, iov, n);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			pthread_mutex_unlock(&lock);
+			die("couldn't write output");
+		}
+
+		for (; n && (size_t) written >= iov->iov_len; ++iov, --n)
+			written -= iov->iov_len;
+		if (n) {
+			iov->iov_base = (char *) iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+}
+
+static void flush(void) {
+	struct iovec iov = { buf, used };
+	used = 0; // first: if this dies, the exit handler mustn't write it all again
+	write_all(&iov, 1);
+}
+
+void out_flush(void) {
+	pthread_mutex_lock(&lock);
+	flush();
+	pthread_mutex_unlock(&lock);
+}
+
+void out_print(value v) {
+	char tmp[24];
+	const char *s;
+	size_t len;
+	switch (classify(v)) {
+	case V_INT:
+		s = tmp;
+		len = format_int(tmp, value2num(v));
+		break;
+	case V_STR:
+		s = str_chars(v, tmp);
+		len = is_short_str(v) ? short_str_len(v) : strlen(s);
+		break;
+	case V_BOOL:
+		s = v == VTRUE ? "true" : "false";
+		len = strlen(s);
+		break;
+	case V_NULL:
+		s = "null";
+		len = 4;
+		break;
+	default:
+		die("can only print strings, ints, booleans and null");
+	}
+
+	pthread_mutex_lock(&lock);
+	if (!started) {
+		started = true;
+		out_line_buffered |= isatty(STDOUT_FILENO);
+		atexit(out_flush);
+	}
+
+	if (len >= OUT_DIRECT) {
+		struct iovec iov[] = { { buf, used }, { (char *) s, len }, { "\n", 1 } };
+		used = 0;
+		write_all(iov, 3);
+	} else {
+		if (used + len + 1 > sizeof(buf)) flush();
+		memcpy(buf + used, s, len);
+		buf[used + len] = '\n';
+		used += len + 1;
+		if (out_line_buffered) flush();
+	}
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,7 @@
+#pragma once
+#include "value.h"
+
+// `print`'s output, buffered, see `out.c`.
+extern bool out_line_buffered; // `--line-buffered`: flush after every line
+void out_print(value v);
+void out_flush(void);
@@ -0,0 +1,260 @@
+#include "memo.h"
+#include "run.h"
+#include <string.h>
+
+/*
+ * Finds functions whose result only depends on their arguments, so `call_value`
+ * can memoize them. A function is pure if it:
+ *   - never assigns to a global,
+ *   - never reads a global that's assigned anywhere in the program,
+ *   - only index-assigns into local arrays it built itself from literals,
+ *   - only calls `length` and other pure functions (by their global name).
+ * Calls are resolved to a fixpoint, so mutually recursive functions work too.
+ */
+
+typedef struct {
+	env *e;
+	char **mutable;
+	int nmutable;
+
+	// per-function state
+	function *fn;
+	char **calls;
+	int ncalls;
+	bool impure;
+
+	const char *candidate;
+	bool fresh;
+} purity;
+
+static bool is_global(env *e, const char *name) {
+	for (int i = 0; i < e->globals.len; ++i)
+		if (!strcmp(e->globals.entries[i].name, name))
+			return true;
+	return false;
+}
+
+static bool is_mutable(purity *p, const char *name) {
+	for (int i = 0; i < p->nmutable; ++i)
+		if (!strcmp(p->mutable[i], name))
+			return true;
+	return false;
+}
+
+static bool is_arg(function *f, const char *name) {
+	for (int i = 0; i < f->argc; ++i)
+		if (!strcmp(f->argv[i], name))
+			return true;
+	return false;
+}
+
+// calls `fn` on every expression in the block, and for every statement's expressions.
+static void walk_expression(purity *p, ast_expression *expr, void (*fn)(purity *, ast_expression *));
+static void walk_primary(purity *p, ast_primary *prim, void (*fn)(purity *, ast_expression *)) {
+	switch (prim->kind) {
+	case AST_PAREN:
+		walk_expression(p, prim->expr, fn);
+		break;
+	case AST_INDEX:
+		walk_expression(p, prim->expr, fn);
+		// fallthru
+	case AST_NEG:
+	case AST_NOT:
+		walk_primary(p, prim->prim, fn);
+		break;
+	case AST_FNCALL:
+		walk_primary(p, prim->prim, fn);
+		// fallthru
+	case AST_ARY:
+	case AST_MAP:
+		for (int i = 0; i < prim->amnt; ++i)
+			walk_expression(p, prim->args[i], fn);
+		break;
+	default:
+		break;
+	}
+}
+
+static void walk_expression(purity *p, ast_expression *expr, void (*fn)(purity *, ast_expression *)) {
+	fn(p, expr);
+
+	switch (expr->kind) {
+	case AST_IDX_ASSIGN:
+	case AST_APPEND:
+		walk_expression(p, expr->index, fn);
+		// fallthru
+	case AST_BINOP:
+	case AST_LTH_LENGTH:
+		walk_primary(p, expr->prim, fn);
+		// fallthru
+	case AST_ASSIGN:
+	case AST_INCR:
+	case AST_EXTEND:
+		walk_expression(p, expr->rhs, fn);
+		break;
+	case AST_PRIM:
+		walk_primary(p, expr->prim, fn);
+		break;
+	}
+}
+
+static void walk_block(purity *p, ast_block *block, void (*fn)(purity *, ast_expression *)) {
+	for (int i = 0; i < block->amnt; ++i) {
+		ast_statement *s = block->stmts[i];
+		switch (s->kind) {
+		case AST_IF:
+			if (s->else_body) walk_block(p, s->else_body, fn);
+			// fallthru
+		case AST_WHILE:
+			walk_block(p, s->body, fn);
+			// fallthru
+		case AST_EXPR:
+		case AST_RETURN:
+			if (s->expr) walk_expression(p, s->expr, fn);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+static void find_mutable(purity *p, ast_expression *expr) {
+	if ((expr->kind != AST_ASSIGN && expr->kind != AST_INCR && expr->kind != AST_EXTEND)
+		|| !is_global(p->e, expr->name) || is_mutable(p, expr->name))
+		return;
+
+	p->mutable = realloc(p->mutable, (p->nmutable + 1) * sizeof(char *));
+	p->mutable[p->nmutable++] = expr->name;
+}
+
+// a local that's only ever assigned array literals, so mutating it can't be observed outside.
+static void check_fresh(purity *p, ast_expression *expr) {
+	if ((expr->kind == AST_ASSIGN || expr->kind == AST_INCR || expr->kind == AST_EXTEND) && !strcmp(expr->name, p->candidate))
+		p->fresh &= expr->kind == AST_ASSIGN && expr->rhs->kind == AST_PRIM && expr->rhs->prim->kind == AST_ARY;
+}
+
+static bool is_fresh_local(purity *p, const char *name) {
+	if (is_global(p->e, name) || is_arg(p->fn, name))
+		return false;
+
+	p->candidate = name;
+	p->fresh = true;
+	walk_block(p, p->fn->block, check_fresh);
+	return p->fresh;
+}
+
+static void check_primary(purity *p, ast_primary *prim);
+static void check_expression(purity *p, ast_expression *expr) {
+	switch (expr->kind) {
+	case AST_ASSIGN:
+	case AST_INCR:
+	case AST_EXTEND:
+		if (is_global(p->e, expr->name)) p->impure = true;
+		break;
+
+	case AST_IDX_ASSIGN:
+	case AST_APPEND:
+		if (expr->prim->kind != AST_VAR || !is_fresh_local(p, expr->prim->ident))
+			p->impure = true;
+		break;
+
+	case AST_BINOP:
+	case AST_LTH_LENGTH:
+	case AST_PRIM:
+		check_primary(p, expr->prim);
+		break;
+	}
+}
+
+static void check_primary(purity *p, ast_primary *prim) {
+	switch (prim->kind) {
+	case AST_PAREN:
+		break; // `walk_expression` gets to the inner expression on its own.
+
+	case AST_INDEX:
+	case AST_NEG:
+	case AST_NOT:
+		check_primary(p, prim->prim);
+		break;
+
+	case AST_FNCALL:
+		if (prim->prim->kind != AST_VAR) {
+			p->impure = true;
+		} else if (builtin_kind(prim->prim->ident)) {
+			if (builtin_kind(prim->prim->ident) != BUILTIN_LENGTH && builtin_kind(prim->prim->ident) != BUILTIN_ADD_CHAIN)
+				p->impure = true;
+		} else if (!is_global(p->e, prim->prim->ident) || is_mutable(p, prim->prim->ident)) {
+			p->impure = true;
+		} else {
+			p->calls = realloc(p->calls, (p->ncalls + 1) * sizeof(char *));
+			p->calls[p->ncalls++] = prim->prim->ident;
+		}
+		break;
+
+	case AST_VAR:
+		if (is_global(p->e, prim->ident) && is_mutable(p, prim->ident))
+			p->impure = true;
+		break;
+
+	default:
+		break;
+	}
+}
+
+void analyze_purity(env *e) {
+	purity p = { .e = e };
+	int nfns = 0;
+	function *fns[e->globals.len];
+	struct { char **names; int len; } calls[e->globals.len];
+
+	for (int i = 0; i < e->globals.len; ++i) {
+		value v = e->globals.entries[i].v;
+		if (classify(v) == V_FUNC && value2func(v)->block)
+			fns[nfns++] = value2func(v);
+	}
+
+	for (int i = 0; i < nfns; ++i)
+		walk_block(&p, fns[i]->block, find_mutable);
+
+	for (int i = 0; i < nfns; ++i) {
+		p.fn = fns[i];
+		p.calls = 0;
+		p.ncalls = 0;
+		p.impure = false;
+		walk_block(&p, fns[i]->block, check_expression);
+
+		fns[i]->pure = !p.impure;
+		calls[i].names = p.calls;
+		calls[i].len = p.ncalls;
+	}
+
+	// anything calling something impure is itself impure.
+	for (bool changed = true; changed; ) {
+		changed = false;
+
+		for (int i = 0; i < nfns; ++i) {
+			if (!fns[i]->pure) continue;
+
+			for (int j = 0; j < calls[i].len; ++j) {
+				value callee = lookup_var(e, calls[i].names[j]);
+				if (classify(callee) != V_FUNC || !value2func(callee)->pure) {
+					fns[i]->pure = false;
+					changed = true;
+					break;
+				}
+			}
+		}
+	}
+
+	for (int i = 0; i < nfns; ++i) {
+		if (fns[i]->pure && !fns[i]->memo)
+			fns[i]->memo = new_memo(MEMO_CAPACITY);
+		else if (!fns[i]->pure && fns[i]->memo) { // something loaded since made it impure
+			free_memo(fns[i]->memo);
+			fns[i]->memo = 0;
+		}
+		free(calls[i].names);
+	}
+
+	free(p.mutable);
+}
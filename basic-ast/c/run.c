@@ -1,20 +1,199 @@
-#include "env.h"
-#include "ast.h"
+#include "run.h"
+#include "memo.h"
 #include "shared.h"
+#include "vec.h"
+#include "sort.h"
+#include "concat.h"
+#include "out.h"
+#include "file.h"
 #include <stdbool.h>
 #include <string.h>
 
+enum engine engine = ENGINE_TREE;
+
 void run_declaration(const ast_declaration *d, env *e) {
-	if (d->kind == AST_GLOBAL) {
+	prepare_declaration(d);
+	load_declaration(d, e);
+}
+
+// the analyses and rewrites that only need doing once, however many envs it's loaded into.
+void prepare_declaration(const ast_declaration *d) {
+	if (d->kind == AST_GLOBAL) return;
+	analyze_escapes(d->block);
+	fuse_idioms(d->block);
+}
+
+// declares it in e. the AST is only read, so any number of threads can do this at once.
+void load_declaration(const ast_declaration *d, env *e) {
+	if (d->kind == AST_GLOBAL)
 		declare_global(e, d->name, VNULL);
-		return;
+	else
+		declare_global(e, d->name, new_function(d->name, d->argc, d->args, d->block));
+}
+
+// non-escaping temporaries live in the scratch region, everything else on the heap.
+void *alloc_temp(bool scratch, int kind, size_t size, env *e) {
+	void *ptr;
+	if (scratch && (ptr = scratch_alloc(e, size)))
+		return ptr;
+	return gc_alloc(kind, size);
+}
+
+// the buffer's allocated first: if allocating the array then collects, the
+// buffer can only be reached through a young array, which is scanned whole.
+value make_array(bool scratch, int len, const value *eles, env *e) {
+	value *buf = alloc_temp(scratch, GC_VALUES, len * sizeof(value), e);
+	array *a = alloc_temp(scratch, GC_ARY, sizeof(array), e);
+	a->eles = memcpy(buf, eles, len * sizeof(value));
+	a->cap = a->len = len;
+	for (int i = 0; i < len; ++i)
+		gc_retain(eles[i]);
+	return ary2value(a);
+}
+
+// builtins shadow any user-defined function of the same name.
+int builtin_kind(const char *name) {
+	if (!strcmp(name, "print")) return BUILTIN_PRINT;
+	if (!strcmp(name, "push")) return BUILTIN_PUSH;
+	if (!strcmp(name, "pop")) return BUILTIN_POP;
+	if (!strcmp(name, "length")) return BUILTIN_LENGTH;
+	if (!strcmp(name, "memoize")) return BUILTIN_MEMOIZE;
+	if (!strcmp(name, "slice")) return BUILTIN_SLICE;
+	if (!strcmp(name, "sum")) return BUILTIN_SUM;
+	if (!strcmp(name, "min")) return BUILTIN_MIN;
+	if (!strcmp(name, "max")) return BUILTIN_MAX;
+	if (!strcmp(name, "fill")) return BUILTIN_FILL;
+	if (!strcmp(name, "dot")) return BUILTIN_DOT;
+	if (!strcmp(name, "map_add")) return BUILTIN_MAP_ADD;
+	if (!strcmp(name, "map_mul")) return BUILTIN_MAP_MUL;
+	if (!strcmp(name, "find")) return BUILTIN_FIND;
+	if (!strcmp(name, "keys")) return BUILTIN_KEYS;
+	if (!strcmp(name, "has")) return BUILTIN_HAS;
+	if (!strcmp(name, "delete")) return BUILTIN_DELETE;
+	if (!strcmp(name, "sort")) return BUILTIN_SORT;
+	if (!strcmp(name, "join")) return BUILTIN_JOIN;
+	if (!strcmp(name, "concat")) return BUILTIN_CONCAT;
+	if (!strcmp(name, "read_file")) return BUILTIN_READ_FILE;
+	if (!strcmp(name, "lines")) return BUILTIN_LINES;
+	if (!strcmp(name, "next_line")) return BUILTIN_NEXT_LINE;
+	if (!strcmp(name, "write_file")) return BUILTIN_WRITE_FILE;
+	if (!strcmp(name, "+")) return BUILTIN_ADD_CHAIN; // not a name anyone can write, see `fuse.c`
+	return 0;
+}
+
+value run_builtin(int kind, int argc, value *args, env *e) {
+	switch (kind) {
+	case BUILTIN_PRINT:
+		if (argc != 1) die("usage: print(value)");
+		out_print(args[0]);
+		return VNULL;
+
+	case BUILTIN_PUSH:
+	case BUILTIN_POP:
+		die("todo(fncall)");
+
+	case BUILTIN_LENGTH:
+		switch (classify(args[0])) {
+		case V_STR:
+			return num2value(is_short_str(args[0]) ? short_str_len(args[0]) : strlen(value2str(args[0])));
+		case V_ARY:
+			return num2value(value2ary(args[0])->len);
+		case V_MAP:
+			return num2value(value2map(args[0])->len);
+		default:
+			die("can only get lengths of arrays, strings and maps");
+		}
+
+	// `memoize(fn, capacity)`: resizes a pure function's cache, `0` turns it off.
+	case BUILTIN_MEMOIZE:;
+		if (argc != 2 || classify(args[0]) != V_FUNC || classify(args[1]) != V_INT)
+			die("usage: memoize(function, capacity)");
+		if (value2num(args[1]) > MEMO_MAX_CAPACITY)
+			die("memoize: capacity can be at most %d", MEMO_MAX_CAPACITY);
+
+		function *f = value2func(args[0]);
+		if (f->memo) free_memo(f->memo);
+		f->memo = f->pure && value2num(args[1]) > 0 ? new_memo(value2num(args[1])) : 0;
+		return f->memo ? VTRUE : VFALSE;
+
+	case BUILTIN_SLICE:
+		if (argc != 3) die("usage: slice(string or array, start, len)");
+		return slice(args[0], args[1], args[2]);
+
+	// see `vec.c`.
+	case BUILTIN_SUM:
+	case BUILTIN_MIN:
+	case BUILTIN_MAX:
+		if (argc != 1) die("usage: sum(array), min(array) or max(array)");
+		return kind == BUILTIN_SUM ? array_sum(args[0]) : array_min(args[0], kind == BUILTIN_MAX);
+	case BUILTIN_FILL:
+		if (argc != 2) die("usage: fill(array, value)");
+		return array_fill(args[0], args[1]);
+	case BUILTIN_DOT:
+		if (argc != 2) die("usage: dot(array, array)");
+		return array_dot(args[0], args[1]);
+	case BUILTIN_MAP_ADD:
+	case BUILTIN_MAP_MUL:
+		if (argc != 2) die("usage: map_add(array, int) or map_mul(array, int)");
+		return array_map(args[0], args[1], kind == BUILTIN_MAP_MUL);
+	case BUILTIN_FIND:
+		if (argc != 2) die("usage: find(array, value)");
+		return array_find(args[0], args[1], e);
+
+	// see `hashmap.c`.
+	case BUILTIN_KEYS:
+		if (argc != 1 || classify(args[0]) != V_MAP) die("usage: keys(map)");
+		return map_keys(args[0]);
+	case BUILTIN_HAS:
+	case BUILTIN_DELETE:
+		if (argc != 2 || classify(args[0]) != V_MAP) die("usage: has(map, key) or delete(map, key)");
+		return (kind == BUILTIN_HAS ? map_has(args[0], args[1]) : map_delete(args[0], args[1])) ? VTRUE : VFALSE;
+
+	// see `sort.c`.
+	case BUILTIN_SORT:
+		if (argc != 1 && argc != 2) die("usage: sort(array) or sort(array, before)");
+		return sort_array(args[0], argc == 2 ? args[1] : VUNDEF, e);
+
+	// see `concat.c`.
+	case BUILTIN_JOIN:
+		if (argc != 2) die("usage: join(array, string)");
+		return join_array(args[0], args[1]);
+	case BUILTIN_CONCAT:
+		return concat_values(argc, args);
+	case BUILTIN_ADD_CHAIN:
+		return add_chain(argc, args, e);
+
+	// see `file.c`.
+	case BUILTIN_READ_FILE:
+		if (argc != 1) die("usage: read_file(path)");
+		return read_file(args[0]);
+	case BUILTIN_LINES:
+		if (argc != 1) die("usage: lines(path)");
+		return open_lines(args[0]);
+	case BUILTIN_NEXT_LINE:
+		if (argc != 1) die("usage: next_line(lines)");
+		return next_line(args[0]);
+	case BUILTIN_WRITE_FILE:
+		if (argc != 2) die("usage: write_file(path, string)");
+		return write_file(args[0], args[1]);
+
+	default:
+		die("unknown builtin %d", kind);
 	}
+}
 
-	declare_global(e, d->name, new_function(d->name, d->argc, d->args, d->block));
+value run_neg(value v) {
+	if (!is_number(v))
+		die("can only negate numbers, not %llx", v);
+	return num2value(-value2num(v));
 }
 
+value run_not(value v) {
+	if (v != VTRUE && v != VFALSE && v != VNULL)
+		die("can only logically negate booleans, not %llx", v);
+	return v == VTRUE ? VFALSE : VTRUE;
+}
 
-value run_expression(ast_expression *expr, env *e);
 value run_primary(ast_primary *prim, env *e){
 	value v1, v2;
 
@@ -27,54 +206,37 @@ value run_primary(ast_primary *prim, env *e){
 		v2 = run_expression(prim->expr, e);
 		return index_into(v1, v2);
 
-	// this is bad. 
 	case AST_FNCALL: {
-		int kind = 0;
-		if (prim->prim->kind == AST_VAR && !strcmp(prim->prim->ident, "print")) kind = 1;
-		else if (prim->prim->kind == AST_VAR && !strcmp(prim->prim->ident, "push")) kind = 2;
-		else if (prim->prim->kind == AST_VAR && !strcmp(prim->prim->ident, "pop")) kind = 3;
-		else if (prim->prim->kind == AST_VAR && !strcmp(prim->prim->ident, "length")) kind = 4;
-		else v1 = run_primary(prim->prim, e);
+		int builtin = prim->prim->kind == AST_VAR ? builtin_kind(prim->prim->ident) : 0;
+		if (!builtin) v1 = run_primary(prim->prim, e);
 
 		value args[prim->amnt];
 		for (int i = 0; i < prim->amnt; ++i)
 			args[i] = run_expression(prim->args[i], e);
 
-		switch (kind){
-		case 0: return call_value(v1, prim->amnt, args, e);
-		case 1: printf("%s\n", value2str(args[0])); return VNULL;
-		case 2: case 3:
-			die("todo(fncall)");
-		case 4:
-			switch (classify(v1)) {
-			case V_STR:
-				return num2value(strlen(value2str(args[0])));
-			case V_ARY:
-				return num2value(value2ary(args[0])->len);
-			default:
-				die("can only get lengths of arrays and strings");
-			}
-		}
+		if (builtin)
+			return run_builtin(builtin, prim->amnt, args, e);
+		return call_value(v1, prim->amnt, args, e);
 	}
 
 	case AST_NEG:
-		v1 = run_primary(prim->prim, e);
-		if (!is_number(v1))
-			die("can only negate numbers, not %llx", v1);
-		return num2value(-value2num(v1));
+		return run_neg(run_primary(prim->prim, e));
 
 	case AST_NOT:
-		v1 = run_primary(prim->prim, e);
-		if (v1 != VTRUE && v1 != VFALSE && v1 != VNULL)
-			die("can only logically negate booleans, not %llx", v1);
-		return v1 != VTRUE;
-
-	case AST_ARY:;
-		array *a = malloc(sizeof(array));
-		a->eles = malloc((a->cap = a->len = prim->amnt) * sizeof(value));
-		for (int i = 0; i < a->len; ++i)
-			a->eles[i] = run_expression(prim->args[i], e);
-		return ary2value(a);
+		return run_not(run_primary(prim->prim, e));
+
+	case AST_ARY: {
+		value eles[prim->amnt];
+		for (int i = 0; i < prim->amnt; ++i)
+			eles[i] = run_expression(prim->args[i], e);
+		return make_array(prim->scratch, prim->amnt, eles, e);
+	}
+	case AST_MAP: {
+		value kvs[prim->amnt];
+		for (int i = 0; i < prim->amnt; ++i)
+			kvs[i] = run_expression(prim->args[i], e);
+		return new_map(prim->amnt, kvs);
+	}
 	case AST_VAR:
 		if ((v1 = lookup_var(e, prim->ident)) == VUNDEF)
 			die("undefined variable '%s' accessed", prim->ident);
@@ -85,9 +247,204 @@ value run_primary(ast_primary *prim, env *e){
 	}
 }
 
+// `a` and `b` joined, as a short string if it fits.
+static value join_strings(const char *a, const char *b, bool scratch, env *e) {
+	size_t len = strlen(a), len2 = strlen(b);
+	char buf[SHORT_STR_MAX + 1], *c = len + len2 <= SHORT_STR_MAX ? buf : alloc_temp(scratch, GC_STR, len + len2 + 1, e);
+	memcpy(c, a, len);
+	memcpy(c + len, b, len2 + 1);
+	return c == buf ? short_str(buf, len + len2) : str2value(c);
+}
+
+// like `strcmp`. two short strings compare like their characters do as big endian numbers.
+int compare_strings(value v, value v2) {
+	if (is_short_str(v) && is_short_str(v2)) {
+		unsigned long long a = __builtin_bswap64(v & ~0xFFULL), b = __builtin_bswap64(v2 & ~0xFFULL);
+		return (a > b) - (a < b);
+	}
+
+	char buf[8], buf2[8];
+	return strcmp(str_chars(v, buf), str_chars(v2, buf2));
+}
+
+value run_binop(token_kind op, value v, value v2, bool scratch, env *e) {
+	switch (op) {
+	case TK_ADD:
+		if (classify(v) == V_INT) {
+			if (classify(v2) != V_INT) die("can only add ints to ints");
+			return num2value(value2num(v) + value2num(v2));
+		}
+
+		if (classify(v) == V_ARY) {
+			if (classify(v2) != V_ARY) die("can only add arys to arys");
+			array *a = value2ary(v), *b = value2ary(v2);
+			value *eles = alloc_temp(scratch, GC_VALUES, (a->len + b->len) * sizeof(value), e);
+			array *ret = alloc_temp(scratch, GC_ARY, sizeof(array), e);
+			ret->eles = eles;
+			ret->len = ret->cap = a->len + b->len;
+			memcpy(ret->eles, a->eles, a->len*sizeof(value));
+			memcpy(ret->eles + a->len, b->eles, b->len*sizeof(value));
+			for (int i = 0; i < ret->len; ++i)
+				gc_retain(ret->eles[i]);
+			return ary2value(ret);
+		}
+
+		if (classify(v) == V_STR) {
+			char buf[8], buf2[8], digits[24];
+			const char *s2;
+			switch (classify(v2)) {
+			case V_NULL: s2 = "null"; break;
+			case V_BOOL: s2 = v2 == VTRUE ? "true" : "false"; break;
+			case V_INT: format_int(digits, value2num(v2)); s2 = digits; break;
+			case V_STR: s2 = str_chars(v2, buf2); break;
+			default: die("todo, convert other types to strings, not %d", classify(v2));
+			}
+			return join_strings(str_chars(v, buf), s2, scratch, e);
+		}
+	case TK_SUB:
+		if (classify(v) != V_INT || classify(v2) != V_INT) die("can only subtract ints from ints");
+		return num2value(value2num(v) - value2num(v2));
+	case TK_MUL:
+		if (classify(v) != V_INT || classify(v2) != V_INT) die("can only multiply ints with ints");
+		return num2value(value2num(v) * value2num(v2));
+	case TK_DIV:
+		if (classify(v) != V_INT || classify(v2) != V_INT) die("can only divide ints from ints");
+		return num2value(value2num(v) / value2num(v2));
+	case TK_MOD:
+		if (classify(v) != V_INT || classify(v2) != V_INT) die("can only modulo ints from ints");
+		return num2value(value2num(v) % value2num(v2));
+
+	case TK_LTH:
+		if (classify(v) != classify(v2)) die("can only compare like types");
+		if (classify(v) == V_INT) return value2num(v) < value2num(v2) ? VTRUE : VFALSE;
+		if (classify(v) == V_STR) return compare_strings(v, v2) < 0 ? VTRUE : VFALSE;
+		if (classify(v) == V_ARY) return array_compare(v, v2) < 0 ? VTRUE : VFALSE;
+		die("can only compare ints, strings and arrays");
+	case TK_GTH:
+		if (classify(v) != classify(v2)) die("can only compare like types");
+		if (classify(v) == V_INT) return value2num(v) > value2num(v2) ? VTRUE : VFALSE;
+		if (classify(v) == V_STR) return compare_strings(v, v2) > 0 ? VTRUE : VFALSE;
+		if (classify(v) == V_ARY) return array_compare(v, v2) > 0 ? VTRUE : VFALSE;
+		die("can only compare ints, strings and arrays");
+	case TK_LEQ:
+		if (classify(v) != classify(v2)) die("can only compare like types");
+		if (classify(v) == V_INT) return value2num(v) <= value2num(v2) ? VTRUE : VFALSE;
+		if (classify(v) == V_STR) return compare_strings(v, v2) <= 0 ? VTRUE : VFALSE;
+		if (classify(v) == V_ARY) return array_compare(v, v2) <= 0 ? VTRUE : VFALSE;
+		die("can only compare ints, strings and arrays");
+	case TK_GEQ:
+		if (classify(v) != classify(v2)) die("can only compare like types");
+		if (classify(v) == V_INT) return value2num(v) >= value2num(v2) ? VTRUE : VFALSE;
+		if (classify(v) == V_STR) return compare_strings(v, v2) >= 0 ? VTRUE : VFALSE;
+		if (classify(v) == V_ARY) return array_compare(v, v2) >= 0 ? VTRUE : VFALSE;
+		die("can only compare ints, strings and arrays");
+
+	case TK_EQL:
+	case TK_NEQ:;
+		int eql = v == v2;
+		if (classify(v) != classify(v2)) eql = 0;
+		else if(classify(v) == V_STR) eql = v == v2 || (!is_short_str(v) && !is_short_str(v2) && !compare_strings(v, v2));
+		else if (classify(v) == V_ARY) eql = array_equal(v, v2);
+
+		if (op == TK_EQL) eql = !eql;
+		return eql ? VFALSE : VTRUE;
+
+	default:
+		die("unknown operator %d encountered", op);
+	}
+}
+
+// length of a GC_ZEROED string: everything past it is zero, so it can be binary searched.
+static size_t zeroed_strlen(const char *s, size_t cap) {
+	size_t lo = 0, hi = cap - 1;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (s[mid]) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// `name = lhs + rhs`, where `lhs` is what `name` held. if nothing else can see
+// it, it's grown in place, with room to spare, instead of copied every time.
+// `*grown` is then what `name` should hold: lhs, or a string with more room.
+bool extend_in_place(value lhs, value rhs, value *grown) {
+	*grown = lhs;
+	if (classify(lhs) == V_ARY) {
+		if (classify(rhs) != V_ARY) return false;
+
+		array *a = value2ary(lhs), *b = value2ary(rhs);
+		unshare_array(a);
+		int len = a->len + b->len;
+		if (len > a->cap) {
+			value *eles = gc_alloc(GC_VALUES, (a->cap = a->cap * 2 > len ? a->cap * 2 : len) * sizeof(value));
+			a->eles = memcpy(eles, a->eles, a->len * sizeof(value));
+		}
+
+		for (int i = 0, n = b->len; i < n; ++i)
+			gc_retain(a->eles[a->len++] = b->eles[i]);
+		gc_array_barrier(a);
+		return true;
+	}
+
+	char buf[32];
+	const char *suffix;
+	switch (classify(rhs)) {
+	case V_NULL: suffix = "null"; break;
+	case V_BOOL: suffix = rhs == VTRUE ? "true" : "false"; break;
+	case V_INT: format_int(buf, value2num(rhs)); suffix = buf; break;
+	case V_STR: suffix = str_chars(rhs, buf); break;
+	default: return false;
+	}
+
+	char *s = value2str(lhs);
+	gc_header *h = GC_HEADER(s);
+	size_t len = h->flags & GC_ZEROED ? zeroed_strlen(s, h->size) : strlen(s), n = strlen(suffix);
+	if (h->flags & GC_ZEROED && len + n < h->size) {
+		memcpy(s + len, suffix, n);
+		return true;
+	}
+
+	char *c = gc_alloc(GC_STR, 2 * (len + n + 1));
+	memcpy(c, s, len);
+	memcpy(c + len, suffix, n);
+	memset(c + len + n, 0, GC_HEADER(c)->size - len - n);
+	GC_HEADER(c)->flags |= GC_ZEROED;
+	*grown = str2value(c);
+	return true;
+}
+
+value run_extend(const char *name, value lhs, value rhs, env *e) {
+	value *ref = lookup_ref(e, name), grown;
+	if (ref && *ref == lhs && gc_unique(lhs) && extend_in_place(lhs, rhs, &grown)) {
+		++fusion_hits[AST_EXTEND - AST_INCR];
+		if (grown != lhs) assign_owned(e, name, grown);
+		return grown;
+	}
+
+	// the result is thrown away, so the new value isn't seen by anyone either.
+	assign_owned(e, name, lhs = run_binop(TK_ADD, lhs, rhs, false, e));
+	return lhs;
+}
+
 value run_expression(ast_expression *expr, env *e){
-	value v, v2, v3;
+	value v, v2, v3, *ref;
 	switch (expr->kind) {
+	case AST_EXTEND:
+		if ((ref = lookup_ref(e, expr->name))) {
+			v = *ref;
+			return run_extend(expr->name, v, run_expression(expr->rhs->rhs, e), e);
+		}
+		// fallthru
+
+	case AST_INCR:
+		if ((ref = lookup_ref(e, expr->name)) && is_number(*ref)) {
+			++fusion_hits[AST_INCR - AST_INCR];
+			v = expr->rhs->rhs->prim->value;
+			return *ref = expr->rhs->binop == TK_ADD ? *ref + v - 4 : *ref - v + 4;
+		}
+		// fallthru
+
 	case AST_ASSIGN:
 		assign_var(e, expr->name, v = run_expression(expr->rhs, e));
 		return v;
@@ -105,103 +462,39 @@ value run_expression(ast_expression *expr, env *e){
 	case AST_BINOP:
 		v = run_primary(expr->prim, e);
 		v2 = run_expression(expr->rhs, e);
-		switch (expr->binop) {
-		case TK_ADD:
-			if (classify(v) == V_INT) {
-				if (classify(v2) != V_INT) die("can only add ints to ints");
-				return num2value(value2num(v) + value2num(v2));
-			}
+		return run_binop(expr->binop, v, v2, expr->scratch, e);
 
-			if (classify(v) == V_ARY) {
-				if (classify(v2) != V_ARY) die("can only add arys to arys");
-				array *ret = malloc(sizeof(array)), *a = value2ary(v), *b = value2ary(v2);
-				ret->eles = malloc((ret->len = ret->cap = a->len+b->len) * sizeof(value));
-				memcpy(ret->eles, a->eles, a->len*sizeof(value));
-				memcpy(ret->eles + a->len, b->eles, b->len*sizeof(value));
-				return ary2value(ret);
-			}
-
-			if (classify(v) == V_STR) {
-				int len = strlen(value2str(v));
-				char *c;
-				switch (classify(v2)) {
-				case V_NULL:
-					strcat(memcpy(c = malloc(len + 5), value2str(v), len + 1), "null");
-					break;
-				case V_BOOL:
-					if (v2 == VTRUE)
-						strcat(memcpy(c = malloc(len + 5), value2str(v), len + 1), "true");
-					else
-						strcat(memcpy(c = malloc(len + 6), value2str(v), len + 1), "false");
-					break;
-				case V_INT:
-					memcpy(c = malloc(47 + len), value2str(v), len + 1);
-					sprintf(c + len, "%lld", value2num(v2));
-					break;
-				case V_STR:
-					strcat(memcpy(c = malloc(len + strlen(value2str(v2))), value2str(v), len+1), value2str(v2));
-					break;
-				default:
-					die("todo, convert other types to strings, not %d", classify(v2));
-				}
-				return str2value(c);
-			}
-		case TK_SUB:
-			if (classify(v) != V_INT || classify(v2) != V_INT) die("can only subtract ints from ints");
-			return num2value(value2num(v) - value2num(v2));
-		case TK_MUL:
-			if (classify(v) != V_INT || classify(v2) != V_INT) die("can only multiply ints with ints");
-			return num2value(value2num(v) * value2num(v2));
-		case TK_DIV:
-			if (classify(v) != V_INT || classify(v2) != V_INT) die("can only divide ints from ints");
-			return num2value(value2num(v) / value2num(v2));
-		case TK_MOD:
-			if (classify(v) != V_INT || classify(v2) != V_INT) die("can only modulo ints from ints");
-			return num2value(value2num(v) % value2num(v2));
-
-		case TK_LTH:
-			if (classify(v) != classify(v2)) die("can only compare like types");
-			if (classify(v) == V_INT) return value2num(v) < value2num(v2) ? VTRUE : VFALSE;
-			if (classify(v) == V_STR) return strcmp(value2str(v), value2str(v2)) < 0 ? VTRUE : VFALSE;
-			die("can only compare ints and strings (and maybe arrays later)");
-		case TK_GTH:
-			if (classify(v) != classify(v2)) die("can only compare like types");
-			if (classify(v) == V_INT) return value2num(v) > value2num(v2) ? VTRUE : VFALSE;
-			if (classify(v) == V_STR) return strcmp(value2str(v), value2str(v2)) > 0 ? VTRUE : VFALSE;
-			die("can only compare ints and strings (and maybe arrays later)");
-		case TK_LEQ:
-			if (classify(v) != classify(v2)) die("can only compare like types");
-			if (classify(v) == V_INT) return value2num(v) <= value2num(v2) ? VTRUE : VFALSE;
-			if (classify(v) == V_STR) return strcmp(value2str(v), value2str(v2)) <= 0 ? VTRUE : VFALSE;
-			die("can only compare ints and strings (and maybe arrays later)");
-		case TK_GEQ:
-			if (classify(v) != classify(v2)) die("can only compare like types");
-			if (classify(v) == V_INT) return value2num(v) >= value2num(v2) ? VTRUE : VFALSE;
-			if (classify(v) == V_STR) return strcmp(value2str(v), value2str(v2)) >= 0 ? VTRUE : VFALSE;
-			die("can only compare ints and strings (and maybe arrays later)");
-
-		case TK_EQL:
-		case TK_NEQ:;
-			int eql = v == v2;
-			if (classify(v) != classify(v2)) eql = 0;
-			else if(classify(v) == V_STR) eql = v == v2 || !strcmp(value2str(v), value2str(v2));
-			else if (classify(v) == V_ARY) die("todo, compare arrays");
-
-			if (expr->binop == TK_EQL) eql = !v;
-			return eql ? VFALSE : VTRUE;
+	case AST_LTH_LENGTH:
+		v = run_primary(expr->prim, e);
+		v2 = run_primary(expr->rhs->prim->args[0]->prim, e);
+		if (is_number(v) && classify(v2) == V_ARY) {
+			++fusion_hits[AST_LTH_LENGTH - AST_INCR];
+			return value2num(v) < value2ary(v2)->len ? VTRUE : VFALSE;
+		}
+		return run_binop(TK_LTH, v, run_builtin(BUILTIN_LENGTH, 1, &v2, e), false, e);
 
-		default:
-			die("unknown operator %d encountered", expr->binop);
+	case AST_APPEND:
+		v = run_primary(expr->prim, e);
+		if (classify(v) == V_ARY) {
+			++fusion_hits[AST_APPEND - AST_INCR];
+			v2 = num2value(value2ary(v)->len);
+		} else {
+			v2 = run_builtin(BUILTIN_LENGTH, 1, &v, e);
 		}
-		return 0;
+		v3 = run_expression(expr->rhs, e);
+		index_assign(v, v2, v3);
+		return v3;
 	}
 }
 
 
-#define NOTHING 0
-#define RETURN_REQUESTED 1
-#define BREAK_REQUESTED 2
-#define CONTINUE_REQUESTED 3
+// anything a statement put in the scratch region is dead once it's done.
+static value run_full_expression(ast_expression *expr, env *e) {
+	size_t scratch_len = e->scratch_len;
+	value v = run_expression(expr, e);
+	e->scratch_len = scratch_len;
+	return v;
+}
 
 int run_block(ast_block *block, value *ret, env *e) {
 	int retkind;
@@ -211,20 +504,25 @@ int run_block(ast_block *block, value *ret, env *e) {
 
 		switch (s->kind) {
 		case AST_RETURN:
-			*ret = s->expr ? run_expression(s->expr, e) : VNULL;
+			*ret = s->expr ? run_full_expression(s->expr, e) : VNULL;
 			return RETURN_REQUESTED;
 
 		case AST_IF:
-			if (value2bool(run_expression(s->expr, e)) ? 
+			if (value2bool(run_full_expression(s->expr, e)) ? 
 				(retkind = run_block(s->body, ret, e)) :
 				s->else_body && (retkind=run_block(s->else_body, ret, e)))
 				return retkind;
 			break;
 
 		case AST_WHILE:
-			while (value2bool(run_expression(s->expr, e))) 
+			while (value2bool(run_full_expression(s->expr, e))) {
 				if ((retkind = run_block(s->body, ret, e)) == BREAK_REQUESTED) break;
 				else if (retkind == RETURN_REQUESTED) return RETURN_REQUESTED;
+				gc_safepoint();
+#ifdef BASICAST_JIT
+				if (e->heat) ++*e->heat;
+#endif
+			}
 			break;
 
 		case AST_BREAK:
@@ -234,7 +532,7 @@ int run_block(ast_block *block, value *ret, env *e) {
 			return CONTINUE_REQUESTED;
 
 		case AST_EXPR:
-			run_expression(s->expr, e);
+			run_full_expression(s->expr, e);
 		}
 	}
 
@@ -0,0 +1,38 @@
+#pragma once
+#include "env.h"
+#include "ast.h"
+#include "gc.h"
+#include "hashmap.h"
+
+enum { BUILTIN_PRINT = 1, BUILTIN_PUSH, BUILTIN_POP, BUILTIN_LENGTH, BUILTIN_MEMOIZE, BUILTIN_SLICE,
+	BUILTIN_SUM, BUILTIN_MIN, BUILTIN_MAX, BUILTIN_FILL, BUILTIN_DOT, BUILTIN_MAP_ADD, BUILTIN_MAP_MUL, BUILTIN_FIND,
+	BUILTIN_KEYS, BUILTIN_HAS, BUILTIN_DELETE, BUILTIN_SORT,
+	BUILTIN_JOIN, BUILTIN_CONCAT, BUILTIN_ADD_CHAIN,
+	BUILTIN_READ_FILE, BUILTIN_LINES, BUILTIN_NEXT_LINE, BUILTIN_WRITE_FILE };
+int builtin_kind(const char *name);
+value run_builtin(int kind, int argc, value *args, env *e);
+
+// which evaluator runs function bodies, see `--engine`.
+extern enum engine { ENGINE_TREE, ENGINE_CLOSURE, ENGINE_STACK } engine;
+
+void run_declaration(const ast_declaration *d, env *e); // `prepare_declaration` then `load_declaration`
+void prepare_declaration(const ast_declaration *d);
+void load_declaration(const ast_declaration *d, env *e);
+value run_neg(value v);
+value run_not(value v);
+void *alloc_temp(bool scratch, int kind, size_t size, env *e);
+value make_array(bool scratch, int len, const value *eles, env *e);
+value run_binop(token_kind op, value lhs, value rhs, bool scratch, env *e);
+int compare_strings(value a, value b); // like `strcmp`
+value run_extend(const char *name, value lhs, value rhs, env *e);
+bool extend_in_place(value lhs, value rhs, value *grown);
+value run_primary(ast_primary *prim, env *e);
+value run_expression(ast_expression *expr, env *e);
+
+// what `run_block` returns.
+#define NOTHING 0
+#define RETURN_REQUESTED 1
+#define BREAK_REQUESTED 2
+#define CONTINUE_REQUESTED 3
+int run_block(ast_block *block, value *ret, env *e);
+value run_stack(ast_block *block, env *e);
@@ -0,0 +1,327 @@
+#include "serve.h"
+#include "run.h"
+#include "file.h"
+#include "out.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+/*
+ * `--serve=path`: the programs are loaded once, and then calls to their
+ * functions are taken as requests on a unix socket at path.
+ *
+ * A request is a connection: the client sends one message and reads one back.
+ * A message is a 4 byte length and then a value:
+ *   'n', 't', 'f'                null, true, false
+ *   'i' + 8 bytes                an int
+ *   's' + 4 byte length + chars  a string
+ *   'a' + 4 byte count + values  an array
+ *   'm' + 4 byte count + pairs   a map, each key followed by its value
+ * with every number little endian. A request is an array of a function's name
+ * then its arguments; the reply is '=' then the result, or '!' then a string
+ * saying what went wrong.
+ *
+ * `--workers=N` processes (a cpu's worth by default) take turns accepting
+ * connections. Each runs every request in a child forked from it, so a request
+ * starts from the programs just as they were loaded, whatever the ones before
+ * it did to the globals, and dying only takes the child with it: its stderr
+ * goes into a pipe, and is what the worker replies with. The first process
+ * only restarts workers that exit.
+ *
+ * A client gets IO_TIMEOUT seconds for each read or write of its connection,
+ * so one that connects and then stalls is dropped rather than tying up a
+ * worker for good. How long the call itself takes isn't limited.
+ */
+
+#define MAX_MESSAGE (64 << 20)
+#define MAX_DEPTH 64 // how deeply nested a value can be sent
+#define MAX_ERROR 4096 // how much of a failed request's stderr is sent back
+#ifndef IO_TIMEOUT
+#define IO_TIMEOUT 10
+#endif
+
+typedef struct {
+	char *buf;
+	size_t len, cap;
+} message;
+
+typedef struct {
+	const unsigned char *p, *end;
+} cursor;
+
+static void read_exactly(int fd, void *buf, size_t n) {
+	for (size_t done = 0; done < n;) {
+		ssize_t got = read(fd, (char *) buf + done, n - done);
+		if (got < 0 && errno == EINTR) continue;
+		if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) die("request timed out");
+		if (got <= 0) die("request cut short");
+		done += got;
+	}
+}
+
+static bool write_exactly(int fd, const void *buf, size_t n) {
+	for (size_t done = 0; done < n;) {
+		ssize_t put = write(fd, (const char *) buf + done, n - done);
+		if (put < 0 && errno == EINTR) continue;
+		if (put < 0) return false;
+		done += put;
+	}
+	return true;
+}
+
+/* values to and from messages */
+
+static const unsigned char *take(cursor *c, size_t n) {
+	if ((size_t) (c->end - c->p) < n) die("malformed request");
+	c->p += n;
+	return c->p - n;
+}
+
+static uint32_t take_u32(cursor *c) {
+	uint32_t x;
+	memcpy(&x, take(c, 4), 4);
+	return x;
+}
+
+// a count of things that take at least a byte each.
+static uint32_t take_count(cursor *c) {
+	uint32_t n = take_u32(c);
+	if (n > c->end - c->p) die("malformed request");
+	return n;
+}
+
+static value decode(cursor *c, int depth) {
+	if (depth > MAX_DEPTH) die("request nested too deeply");
+
+	switch (*take(c, 1)) {
+	case 'n': return VNULL;
+	case 't': return VTRUE;
+	case 'f': return VFALSE;
+
+	case 'i':;
+		long long n;
+		memcpy(&n, take(c, 8), 8);
+		if (value2num(num2value(n)) != n) die("%lld is too big to be an int", n);
+		return num2value(n);
+
+	case 's':;
+		uint32_t len = take_u32(c);
+		return string_of((const char *) take(c, len), len, 0);
+
+	case 'a':;
+		uint32_t count = take_count(c);
+		value a = new_array(0, 0);
+		if (count) index_assign(a, num2value(count - 1), VNULL); // sized up front
+		for (uint32_t i = 0; i < count; ++i)
+			index_assign(a, num2value(i), decode(c, depth + 1));
+		return a;
+
+	case 'm':;
+		uint32_t pairs = take_count(c);
+		value m = new_map(0, 0);
+		for (uint32_t i = 0; i < pairs; ++i) {
+			value k = decode(c, depth + 1);
+			map_set(m, k, decode(c, depth + 1));
+		}
+		return m;
+
+	default:
+		die("malformed request");
+	}
+}
+
+static void put(message *m, const void *p, size_t n) {
+	if (m->len + n > m->cap)
+		m->buf = realloc(m->buf, m->cap = 2 * (m->len + n));
+	memcpy(m->buf + m->len, p, n);
+	m->len += n;
+}
+
+static void put_u32(message *m, uint32_t x) {
+	put(m, &x, 4);
+}
+
+static void encode(message *m, value v, int depth) {
+	if (depth > MAX_DEPTH) die("result nested too deeply to send");
+
+	char buf[8];
+	switch (classify(v)) {
+	case V_NULL:
+		put(m, "n", 1);
+		break;
+	case V_BOOL:
+		put(m, v == VTRUE ? "t" : "f", 1);
+		break;
+
+	case V_INT:;
+		long long n = value2num(v);
+		put(m, "i", 1);
+		put(m, &n, 8);
+		break;
+
+	case V_STR:;
+		const char *s = str_chars(v, buf);
+		size_t len = is_short_str(v) ? short_str_len(v) : strlen(s);
+		put(m, "s", 1);
+		put_u32(m, len);
+		put(m, s, len);
+		break;
+
+	case V_ARY:;
+		array *a = value2ary(v);
+		put(m, "a", 1);
+		put_u32(m, a->len);
+		for (int i = 0; i < a->len; ++i)
+			encode(m, a->eles[i], depth + 1);
+		break;
+
+	case V_MAP:
+		put(m, "m", 1);
+		put_u32(m, value2map(v)->len);
+		value k, x;
+		for (int i = 0; (i = map_next(v, i, &k, &x));) {
+			encode(m, k, depth + 1);
+			encode(m, x, depth + 1);
+		}
+		break;
+
+	case V_FUNC:
+		die("can't send a function");
+	}
+}
+
+// `kind` and then the value, with the length in front.
+static void send_message(int fd, char kind, value v) {
+	message m = { 0 };
+	put(&m, "\0\0\0\0", 4);
+	put(&m, &kind, 1);
+	encode(&m, v, 0);
+
+	uint32_t len = m.len - 4;
+	memcpy(m.buf, &len, 4);
+	write_exactly(fd, m.buf, m.len);
+	free(m.buf);
+}
+
+/* requests */
+
+// in the child: reads a request, makes the call and replies.
+static void handle(int conn, env *e) {
+	uint32_t len;
+	read_exactly(conn, &len, 4);
+	if (len > MAX_MESSAGE) die("request too big");
+	unsigned char *buf = malloc(len);
+	read_exactly(conn, buf, len);
+
+	cursor c = { buf, buf + len };
+	value req = decode(&c, 0);
+	array *a = classify(req) == V_ARY ? value2ary(req) : 0;
+	if (c.p != c.end || !a || !a->len || classify(a->eles[0]) != V_STR)
+		die("a request is an array of a function's name and its arguments");
+	free(buf);
+
+	char name[8];
+	const char *fname = str_chars(a->eles[0], name);
+	value f = lookup_var(e, fname);
+	if (f == VUNDEF || classify(f) != V_FUNC) die("there's no function %s", fname);
+
+	// the args go on the stack, where the array's buffer might move away from under them.
+	int argc = a->len - 1;
+	value args[argc + 1];
+	memcpy(args, a->eles + 1, argc * sizeof(value));
+	send_message(conn, '=', call_value(f, argc, args, e));
+}
+
+static void serve_one(int conn, env *e) {
+	int err[2];
+	if (pipe(err) < 0) die("couldn't make a pipe");
+
+	out_flush(); // or the child would print what's buffered too
+	pid_t pid = fork();
+	if (!pid) {
+		close(err[0]);
+		dup2(err[1], STDERR_FILENO);
+		close(err[1]);
+		handle(conn, e);
+		exit(0);
+	}
+	close(err[1]);
+
+	char msg[MAX_ERROR], rest[512];
+	size_t len = 0;
+	for (ssize_t got; (got = len < MAX_ERROR ? read(err[0], msg + len, MAX_ERROR - len) : read(err[0], rest, sizeof(rest)));) {
+		if (got < 0 && errno == EINTR) continue;
+		if (got < 0) break;
+		if (len < MAX_ERROR) len += got;
+	}
+	close(err[0]);
+
+	int status = 0;
+	if (pid > 0)
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+	if (pid < 0)
+		len = snprintf(msg, MAX_ERROR, "couldn't fork");
+	else if (WIFSIGNALED(status) && !len)
+		len = snprintf(msg, MAX_ERROR, "killed by signal %d", WTERMSIG(status));
+	else if (WIFEXITED(status) && !WEXITSTATUS(status))
+		return;
+
+	while (len && msg[len - 1] == '\n') --len;
+	send_message(conn, '!', string_of(msg, len, 0));
+}
+
+static void worker(int sock, env *e) {
+#ifdef __linux__
+	prctl(PR_SET_PDEATHSIG, SIGTERM); // go when the server does
+#endif
+	for (;;) {
+		int conn = accept(sock, 0, 0);
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			die("couldn't accept connections");
+		}
+		struct timeval timeout = { .tv_sec = IO_TIMEOUT };
+		setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		serve_one(conn, e);
+		close(conn);
+	}
+}
+
+void serve(const char *path, int workers, env *e) {
+	signal(SIGPIPE, SIG_IGN); // a client that's gone is just a failed write
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) die("socket path too long: %s", path);
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0 || bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(sock, SOMAXCONN) < 0)
+		die("couldn't listen on %s", path);
+
+	if (workers <= 0) workers = sysconf(_SC_NPROCESSORS_ONLN);
+	pid_t *pids = calloc(workers, sizeof(pid_t));
+	for (;;) {
+		for (int i = 0; i < workers; ++i) {
+			if (pids[i]) continue;
+			out_flush();
+			if (!(pids[i] = fork())) worker(sock, e);
+			if (pids[i] < 0) die("couldn't start workers");
+		}
+
+		pid_t pid = wait(0);
+		if (pid < 0 && errno != EINTR) die("lost track of the workers");
+		for (int i = 0; i < workers; ++i)
+			if (pids[i] == pid) pids[i] = 0;
+	}
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+// `--serve=path`: answers requests to call the loaded programs' functions, see `serve.c`. never returns.
+struct env;
+void serve(const char *path, int workers, struct env *e);
@@ -1,5 +1,12 @@
 #pragma once
 #include <stdio.h>
 #include <stdlib.h>
+#include <setjmp.h>
 
-#define die(...) (fprintf(stderr, __VA_ARGS__), exit(1))
+// prints the message and exits, or, while something's catching errors (see
+// `basicast.c`), leaves the message in `die_message` and jumps to `die_handler`.
+// both are per thread.
+#define die(...) die_with(__VA_ARGS__)
+extern __thread jmp_buf *die_handler;
+extern __thread char die_message[1024];
+__attribute__((noreturn)) void die_with(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
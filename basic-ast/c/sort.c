@@ -0,0 +1,349 @@
+#include "sort.h"
+#include "vec.h"
+#include "run.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * `sort(a)` and `sort(a, before)`: sorts a in place, and returns it.
+ *
+ * All-int arrays get an LSD radix sort, a byte at a time, skipping the bytes
+ * every element has in common. All-string arrays get a multikey quicksort,
+ * which partitions on one character at a time and so never looks at a common
+ * prefix twice. Anything else, or any array given a `before(x, y)` (whether x
+ * goes before y), gets pdqsort: quicksort that notices sorted runs, lumps
+ * equal elements together, and falls back on heapsort when its pivots keep
+ * coming out bad.
+ *
+ * `before` can do anything, including allocate, which can move the array's
+ * buffer and what's in it. So those sorts work on a copy the collector knows
+ * about (see `gc_push_roots`), and only the final order is stored back. A
+ * comparator that isn't consistent gets some order, just not a sorted one.
+ */
+
+/* pdqsort */
+
+#define INSERTION_SORT_THRESHOLD 24
+#define NINTHER_THRESHOLD 128
+#define PARTIAL_INSERTION_SORT_LIMIT 8
+
+typedef struct {
+	value before; // the user's comparator, or VUNDEF
+	value args[2];
+	env *e;
+} sorter;
+
+static bool less(sorter *s, value x, value y) {
+	if (s->before == VUNDEF) return compare_values(x, y) < 0;
+	s->args[0] = x;
+	s->args[1] = y;
+	return value2bool(call_value(s->before, 2, s->args, s->e));
+}
+
+#define SWAP(a, b) do { value t_ = (a); (a) = (b); (b) = t_; } while (0)
+
+static void sort2(value *a, value *b, sorter *s) {
+	if (less(s, *b, *a)) SWAP(*a, *b);
+}
+
+static void sort3(value *a, value *b, value *c, sorter *s) {
+	sort2(a, b, s);
+	sort2(b, c, s);
+	sort2(a, b, s);
+}
+
+static void insertion_sort(value *v, int n, sorter *s) {
+	for (int i = 1; i < n; ++i) {
+		value x = v[i];
+		int j = i;
+		for (; j > 0 && less(s, x, v[j - 1]); --j)
+			v[j] = v[j - 1];
+		v[j] = x;
+	}
+}
+
+// an insertion sort that gives up once it's had to move too many elements.
+static bool partial_insertion_sort(value *v, int n, sorter *s) {
+	for (int i = 1, moved = 0; i < n; ++i) {
+		if (moved > PARTIAL_INSERTION_SORT_LIMIT) return false;
+
+		value x = v[i];
+		int j = i;
+		for (; j > 0 && less(s, x, v[j - 1]); --j)
+			v[j] = v[j - 1];
+		v[j] = x;
+		moved += i - j;
+	}
+	return true;
+}
+
+static void sift_down(value *v, int n, int i, sorter *s) {
+	for (int child; (child = 2 * i + 1) < n; i = child) {
+		if (child + 1 < n && less(s, v[child], v[child + 1])) ++child;
+		if (!less(s, v[i], v[child])) return;
+		SWAP(v[i], v[child]);
+	}
+}
+
+static void heap_sort(value *v, int n, sorter *s) {
+	for (int i = n / 2 - 1; i >= 0; --i)
+		sift_down(v, n, i, s);
+	for (int i = n - 1; i > 0; --i) {
+		SWAP(v[0], v[i]);
+		sift_down(v, i, 0, s);
+	}
+}
+
+// partitions around v[0]: what's less to its left, the rest to its right.
+// returns where it ends up, and whether nothing needed to move.
+static int partition_right(value *v, int n, sorter *s, bool *already) {
+	value pivot = v[0];
+	int i = 1, j = n - 1;
+	while (i < n && less(s, v[i], pivot)) ++i;
+	while (j >= i && !less(s, v[j], pivot)) --j;
+	*already = i >= j;
+
+	while (i < j) {
+		SWAP(v[i], v[j]);
+		while (++i < n && less(s, v[i], pivot));
+		while (--j > 0 && !less(s, v[j], pivot));
+	}
+
+	v[0] = v[i - 1];
+	v[i - 1] = pivot;
+	return i - 1;
+}
+
+// like `partition_right`, but what's equal goes to the left. for when v[0] is
+// known to be no less than anything to its left, so those are all done.
+static int partition_left(value *v, int n, sorter *s) {
+	value pivot = v[0];
+	int i = 1, j = n - 1;
+	while (j > 0 && less(s, pivot, v[j])) --j;
+	while (i < j && !less(s, pivot, v[i])) ++i;
+
+	while (i < j) {
+		SWAP(v[i], v[j]);
+		while (--j > 0 && less(s, pivot, v[j]));
+		while (++i < j && !less(s, pivot, v[i]));
+	}
+
+	v[0] = v[j];
+	v[j] = pivot;
+	return j;
+}
+
+// `bad` is how many more unbalanced partitions to put up with before heapsorting.
+static void pdqsort(value *v, int n, sorter *s, int bad, bool leftmost) {
+	for (;;) {
+		if (n < INSERTION_SORT_THRESHOLD) {
+			insertion_sort(v, n, s);
+			return;
+		}
+
+		// the pivot (a median of 3, or of 3 medians) goes to v[0].
+		int half = n / 2;
+		if (n > NINTHER_THRESHOLD) {
+			sort3(v, v + half, v + n - 1, s);
+			sort3(v + 1, v + half - 1, v + n - 2, s);
+			sort3(v + 2, v + half + 1, v + n - 3, s);
+			sort3(v + half - 1, v + half, v + half + 1, s);
+			SWAP(v[0], v[half]);
+		} else {
+			sort3(v + half, v, v + n - 1, s);
+		}
+
+		// v[-1] was a pivot, so nothing here is less. if v[0] isn't more, it's one
+		// of many equal elements: they all go left, and that's them done.
+		if (!leftmost && !less(s, v[-1], v[0])) {
+			int pos = partition_left(v, n, s);
+			v += pos + 1;
+			n -= pos + 1;
+			continue;
+		}
+
+		bool already;
+		int pos = partition_right(v, n, s, &already), l = pos, r = n - pos - 1;
+
+		if (l < n / 8 || r < n / 8) {
+			if (--bad == 0) {
+				heap_sort(v, n, s);
+				return;
+			}
+
+			// shuffle a few elements around, so the next pivots come out different.
+			if (l >= INSERTION_SORT_THRESHOLD) {
+				SWAP(v[0], v[l / 4]);
+				SWAP(v[pos - 1], v[pos - l / 4]);
+				if (l > NINTHER_THRESHOLD) {
+					SWAP(v[1], v[l / 4 + 1]);
+					SWAP(v[2], v[l / 4 + 2]);
+					SWAP(v[pos - 2], v[pos - (l / 4 + 1)]);
+					SWAP(v[pos - 3], v[pos - (l / 4 + 2)]);
+				}
+			}
+			if (r >= INSERTION_SORT_THRESHOLD) {
+				SWAP(v[pos + 1], v[pos + 1 + r / 4]);
+				SWAP(v[n - 1], v[n - r / 4]);
+				if (r > NINTHER_THRESHOLD) {
+					SWAP(v[pos + 2], v[pos + 2 + r / 4]);
+					SWAP(v[pos + 3], v[pos + 3 + r / 4]);
+					SWAP(v[n - 2], v[n - (1 + r / 4)]);
+					SWAP(v[n - 3], v[n - (2 + r / 4)]);
+				}
+			}
+		} else if (already && partial_insertion_sort(v, l, s) && partial_insertion_sort(v + pos + 1, r, s)) {
+			return; // it was (nearly) sorted already
+		}
+
+		pdqsort(v, l, s, bad, leftmost);
+		v += pos + 1;
+		n = r;
+		leftmost = false;
+	}
+}
+
+static int log2_of(int n) {
+	int log = 0;
+	while (n >>= 1) ++log;
+	return log;
+}
+
+/* radix sort */
+
+static void radix_sort(value *v, int n) {
+	size_t counts[8][256] = { 0 };
+
+	// flipping the sign bit makes signed order unsigned order.
+	for (int i = 0; i < n; ++i) {
+		unsigned long long u = v[i] ^ 1ULL << 63;
+		for (int b = 0; b < 8; ++b)
+			++counts[b][u >> 8 * b & 0xFF];
+	}
+
+	value *tmp = malloc(n * sizeof(value)), *from = v, *to = tmp;
+	for (int b = 0; b < 8; ++b) {
+		size_t *count = counts[b], sum = 0;
+		if (count[(from[0] ^ 1ULL << 63) >> 8 * b & 0xFF] == n) continue; // they all have this byte
+
+		for (int d = 0; d < 256; ++d) {
+			size_t c = count[d];
+			count[d] = sum;
+			sum += c;
+		}
+		for (int i = 0; i < n; ++i)
+			to[count[(from[i] ^ 1ULL << 63) >> 8 * b & 0xFF]++] = from[i];
+
+		value *t = from;
+		from = to;
+		to = t;
+	}
+
+	if (from != v) memcpy(v, from, n * sizeof(value));
+	free(tmp);
+}
+
+/* multikey quicksort */
+
+typedef struct {
+	const unsigned char *s;
+	value v;
+} keyed;
+
+static void swap_keyed(keyed *a, keyed *b) {
+	keyed t = *a;
+	*a = *b;
+	*b = t;
+}
+
+// sorts k by the strings from their `d`th character on, all before that being equal.
+static void multikey_sort(keyed *k, int n, int d) {
+	while (n > 1) {
+		if (n < 16) {
+			for (int i = 1; i < n; ++i)
+				for (int j = i; j > 0 && strcmp((char *) k[j].s + d, (char *) k[j - 1].s + d) < 0; --j)
+					swap_keyed(&k[j], &k[j - 1]);
+			return;
+		}
+
+		// median of 3 characters, into k[0].
+		int a = k[0].s[d], b = k[n / 2].s[d], c = k[n - 1].s[d];
+		int mid = (a < b) == (b < c) ? n / 2 : (a < b) == (a < c) ? n - 1 : 0;
+		swap_keyed(&k[0], &k[mid]);
+
+		// three ways: less, equal, then greater at d.
+		int pivot = k[0].s[d], lt = 0, i = 1, gt = n - 1;
+		while (i <= gt) {
+			int ch = k[i].s[d];
+			if (ch < pivot) swap_keyed(&k[lt++], &k[i++]);
+			else if (ch > pivot) swap_keyed(&k[i], &k[gt--]);
+			else ++i;
+		}
+
+		multikey_sort(k, lt, d);
+		multikey_sort(k + gt + 1, n - gt - 1, d);
+		if (!pivot) return; // the equal ones ended here, so they're just equal
+
+		k += lt;
+		n = gt - lt + 1;
+		++d;
+	}
+}
+
+static void string_sort(value *v, int n) {
+	keyed *k = malloc(n * sizeof(keyed));
+	char (*shorts)[8] = malloc(n * sizeof(*shorts));
+	for (int i = 0; i < n; ++i) {
+		k[i].s = (const unsigned char *) str_chars(v[i], shorts[i]);
+		k[i].v = v[i];
+	}
+
+	multikey_sort(k, n, 0);
+	for (int i = 0; i < n; ++i)
+		v[i] = k[i].v;
+	free(shorts);
+	free(k);
+}
+
+/* the builtin */
+
+value sort_array(value av, value before, env *e) {
+	if (classify(av) != V_ARY) die("can only sort arrays");
+	if (before != VUNDEF && classify(before) != V_FUNC) die("sort's comparator has to be a function");
+
+	array *a = value2ary(av);
+	unshare_array(a);
+	int n = a->len;
+	if (n < 2) return av;
+
+	if (before == VUNDEF) {
+		bool ints = true, strs = true;
+		for (int i = 0; i < n && (ints || strs); ++i) {
+			ints &= classify(a->eles[i]) == V_INT;
+			strs &= classify(a->eles[i]) == V_STR;
+		}
+
+		sorter s = { VUNDEF, { 0 }, e };
+		if (ints) radix_sort(a->eles, n);
+		else if (strs) string_sort(a->eles, n);
+		else pdqsort(a->eles, n, &s, log2_of(n), true);
+		gc_array_barrier(a);
+		return av;
+	}
+
+	size_t len = n;
+	value *copy = malloc(n * sizeof(value));
+	memcpy(copy, a->eles, n * sizeof(value));
+	gc_roots roots = { &copy, &len };
+	gc_push_roots(&roots);
+
+	sorter s = { before, { 0 }, e };
+	pdqsort(copy, n, &s, log2_of(n), true);
+
+	gc_pop_roots(&roots);
+	if (a->len != n) die("array changed length while being sorted");
+	memcpy(a->eles, copy, n * sizeof(value)); // re-read, the comparator might've moved it
+	free(copy);
+	gc_array_barrier(a);
+	return av;
+}
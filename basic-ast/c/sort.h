@@ -0,0 +1,6 @@
+#pragma once
+#include "value.h"
+
+// `sort(a)` and `sort(a, before)`, see `sort.c`. `before` is VUNDEF if not given.
+struct env;
+value sort_array(value a, value before, struct env *e);
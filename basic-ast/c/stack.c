@@ -0,0 +1,414 @@
+#include "run.h"
+#include "shared.h"
+#include <stdlib.h>
+
+/*
+ * Non-recursive evaluator (`--engine=stack`). Instead of recursing in C, all
+ * pending work lives on two heap-allocated stacks:
+ *   - the task stack, holding what's left to do: evaluate some node, or a
+ *     continuation that combines the results of nodes evaluated before it.
+ *   - the value stack, where those results wait to be combined.
+ *
+ * Calls to user functions push a K_FUNC task and keep going in the same loop,
+ * so neither long right-nested binops nor deep recursion touch the C stack;
+ * the only limit is `stackframe_limit` (`--max-depth`). `return`, `break` and
+ * `continue` just pop tasks until they reach the K_FUNC or K_LOOP they belong to.
+ *
+ * Everything else goes through the same runtime helpers as `run.c`, so
+ * behavior is identical to the tree walker.
+ */
+
+typedef struct {
+	enum {
+		// evaluate `node`, leaving its result on the value stack (blocks leave nothing).
+		X_BLOCK, X_EXPR, X_PRIM,
+
+		// statement continuations. `mark` is the scratch region's length to restore.
+		K_DISCARD, K_RETURN, K_IF, K_WHILE, K_LOOP,
+
+		// expression continuations, popping their operands off the value stack.
+		K_ASSIGN, K_EXTEND, K_IDX_ASSIGN, K_LENGTH, K_BINOP, K_LTH_LENGTH,
+		K_INDEX, K_CALL, K_NEG, K_NOT, K_ARY, K_MAP,
+
+		// a user function's body is running. `mark` is where its callee and args
+		// start on the value stack, `node` the function (null for the outermost).
+		K_FUNC
+	} op;
+
+	int i; // X_BLOCK: next statement; K_CALL: builtin kind
+	const void *node;
+	size_t mark;
+#ifdef BASICAST_JIT
+	int *heat; // K_FUNC: the caller's `e->heat`
+#endif
+} task;
+
+typedef struct {
+	task *tasks;
+	size_t ntasks, taskcap;
+
+	value *vals;
+	size_t nvals, valcap;
+} machine;
+
+static task *push_task(machine *m, int op, const void *node, size_t mark) {
+	if (m->ntasks == m->taskcap)
+		m->tasks = realloc(m->tasks, (m->taskcap = m->taskcap * 2 + 64) * sizeof(task));
+
+	task *t = &m->tasks[m->ntasks++];
+	t->op = op;
+	t->i = 0;
+	t->node = node;
+	t->mark = mark;
+	return t;
+}
+
+static void push_value(machine *m, value v) {
+	if (m->nvals == m->valcap)
+		m->vals = realloc(m->vals, (m->valcap = m->valcap * 2 + 64) * sizeof(value));
+	m->vals[m->nvals++] = v;
+}
+
+#define POP() (m.vals[--m.nvals])
+#define TOP() (m.vals[m.nvals - 1])
+
+// pushes the tasks to evaluate `prim` onto `m`, in reverse so they run in source order.
+static void push_primary(machine *m, ast_primary *prim, env *e) {
+	value v;
+
+	switch (prim->kind) {
+	case AST_PAREN:
+		push_task(m, X_EXPR, prim->expr, 0);
+		break;
+
+	case AST_INDEX:
+		push_task(m, K_INDEX, prim, 0);
+		push_task(m, X_EXPR, prim->expr, 0);
+		push_task(m, X_PRIM, prim->prim, 0);
+		break;
+
+	case AST_FNCALL:;
+		int builtin = prim->prim->kind == AST_VAR ? builtin_kind(prim->prim->ident) : 0;
+		push_task(m, K_CALL, prim, 0)->i = builtin;
+		for (int i = prim->amnt - 1; i >= 0; --i)
+			push_task(m, X_EXPR, prim->args[i], 0);
+		if (!builtin) push_task(m, X_PRIM, prim->prim, 0);
+		break;
+
+	case AST_NEG:
+	case AST_NOT:
+		push_task(m, prim->kind == AST_NEG ? K_NEG : K_NOT, prim, 0);
+		push_task(m, X_PRIM, prim->prim, 0);
+		break;
+
+	case AST_ARY:
+	case AST_MAP:
+		push_task(m, prim->kind == AST_ARY ? K_ARY : K_MAP, prim, 0);
+		for (int i = prim->amnt - 1; i >= 0; --i)
+			push_task(m, X_EXPR, prim->args[i], 0);
+		break;
+
+	case AST_VAR:
+		if ((v = lookup_var(e, prim->ident)) == VUNDEF)
+			die("undefined variable '%s' accessed", prim->ident);
+		push_value(m, v);
+		break;
+
+	case AST_LITERAL:
+		push_value(m, prim->value);
+		break;
+	}
+}
+
+static void push_expression(machine *m, ast_expression *expr, env *e) {
+	value *ref;
+
+	switch (expr->kind) {
+	case AST_EXTEND:
+		if ((ref = lookup_ref(e, expr->name))) {
+			push_value(m, *ref);
+			push_task(m, K_EXTEND, expr, 0);
+			push_task(m, X_EXPR, expr->rhs->rhs, 0);
+			break;
+		}
+		// fallthru
+
+	case AST_INCR:
+		if ((ref = lookup_ref(e, expr->name)) && is_number(*ref)) {
+			++fusion_hits[AST_INCR - AST_INCR];
+			value step = expr->rhs->rhs->prim->value;
+			push_value(m, *ref = expr->rhs->binop == TK_ADD ? *ref + step - 4 : *ref - step + 4);
+			break;
+		}
+		// fallthru
+
+	case AST_ASSIGN:
+		push_task(m, K_ASSIGN, expr, 0);
+		push_task(m, X_EXPR, expr->rhs, 0);
+		break;
+
+	case AST_IDX_ASSIGN:
+		push_task(m, K_IDX_ASSIGN, expr, 0);
+		push_task(m, X_EXPR, expr->rhs, 0);
+		push_task(m, X_EXPR, expr->index, 0);
+		push_task(m, X_PRIM, expr->prim, 0);
+		break;
+
+	case AST_APPEND:
+		push_task(m, K_IDX_ASSIGN, expr, 0);
+		push_task(m, X_EXPR, expr->rhs, 0);
+		push_task(m, K_LENGTH, expr, 0);
+		push_task(m, X_PRIM, expr->prim, 0);
+		break;
+
+	case AST_PRIM:
+		push_primary(m, expr->prim, e);
+		break;
+
+	case AST_BINOP:
+		push_task(m, K_BINOP, expr, 0);
+		push_task(m, X_EXPR, expr->rhs, 0);
+		push_task(m, X_PRIM, expr->prim, 0);
+		break;
+
+	case AST_LTH_LENGTH:
+		push_task(m, K_LTH_LENGTH, expr, 0);
+		push_task(m, X_PRIM, expr->rhs->prim->args[0]->prim, 0);
+		push_task(m, X_PRIM, expr->prim, 0);
+		break;
+	}
+}
+
+// pops tasks up to (not including) the innermost K_FUNC, or K_LOOP if `loop`.
+static task *unwind(machine *m, bool loop) {
+	while (m->tasks[m->ntasks - 1].op != K_FUNC && !(loop && m->tasks[m->ntasks - 1].op == K_LOOP))
+		--m->ntasks;
+	return &m->tasks[m->ntasks - 1];
+}
+
+value run_stack(ast_block *block, env *e) {
+	machine m = { 0 };
+	value v, v2, v3;
+	function *f;
+
+	gc_roots roots = { &m.vals, &m.nvals };
+	gc_push_roots(&roots);
+
+	push_task(&m, K_FUNC, 0, 0);
+	push_task(&m, X_BLOCK, block, 0);
+
+	for (;;) {
+		task t = m.tasks[--m.ntasks];
+
+		switch (t.op) {
+		case X_BLOCK:;
+			const ast_block *b = t.node;
+			if (t.i == b->amnt)
+				break;
+
+			ast_statement *s = b->stmts[t.i++];
+			m.tasks[m.ntasks++] = t;
+
+			switch (s->kind) {
+			case AST_RETURN:
+				if (!s->expr) {
+					push_value(&m, VNULL);
+					unwind(&m, false);
+					goto leave;
+				}
+				push_task(&m, K_RETURN, s, e->scratch_len);
+				break;
+			case AST_IF:
+				push_task(&m, K_IF, s, e->scratch_len);
+				break;
+			case AST_WHILE:
+				push_task(&m, K_WHILE, s, e->scratch_len);
+				break;
+			case AST_BREAK:
+			case AST_CONTINUE:
+				if (unwind(&m, true)->op == K_FUNC) {
+					push_value(&m, VNULL);
+					goto leave;
+				}
+				if (s->kind == AST_BREAK) --m.ntasks;
+				continue;
+			case AST_EXPR:
+				push_task(&m, K_DISCARD, s, e->scratch_len);
+				break;
+			}
+
+			push_expression(&m, s->expr, e);
+			break;
+
+		case X_EXPR:
+			push_expression(&m, (ast_expression *) t.node, e);
+			break;
+
+		case X_PRIM:
+			push_primary(&m, (ast_primary *) t.node, e);
+			break;
+
+		case K_DISCARD:
+			--m.nvals;
+			e->scratch_len = t.mark;
+			break;
+
+		case K_RETURN:
+			e->scratch_len = t.mark;
+			unwind(&m, false);
+			goto leave;
+
+		case K_IF:;
+			const ast_statement *is = t.node;
+			e->scratch_len = t.mark;
+			if (value2bool(POP()))
+				push_task(&m, X_BLOCK, is->body, 0);
+			else if (is->else_body)
+				push_task(&m, X_BLOCK, is->else_body, 0);
+			break;
+
+		case K_WHILE:
+			e->scratch_len = t.mark;
+			if (value2bool(POP())) {
+				push_task(&m, K_LOOP, t.node, 0);
+				push_task(&m, X_BLOCK, ((const ast_statement *) t.node)->body, 0);
+			}
+			break;
+
+		case K_LOOP: // the body's done (or `continue`d), check the condition again.
+			gc_safepoint();
+#ifdef BASICAST_JIT
+			if (e->heat) ++*e->heat;
+#endif
+			push_task(&m, K_WHILE, t.node, e->scratch_len);
+			push_expression(&m, ((const ast_statement *) t.node)->expr, e);
+			break;
+
+		case K_ASSIGN:
+			assign_var(e, ((const ast_expression *) t.node)->name, TOP());
+			break;
+
+		case K_EXTEND:
+			v2 = POP();
+			v = POP();
+			push_value(&m, run_extend(((const ast_expression *) t.node)->name, v, v2, e));
+			break;
+
+		case K_IDX_ASSIGN:
+			v3 = POP();
+			v2 = POP();
+			v = POP();
+			index_assign(v, v2, v3);
+			push_value(&m, v3);
+			break;
+
+		case K_LENGTH: // the array of an AST_APPEND is on top, push its length.
+			if (classify(v = TOP()) == V_ARY) {
+				++fusion_hits[AST_APPEND - AST_INCR];
+				push_value(&m, num2value(value2ary(v)->len));
+			} else {
+				push_value(&m, run_builtin(BUILTIN_LENGTH, 1, &v, e));
+			}
+			break;
+
+		case K_BINOP:;
+			const ast_expression *bin = t.node;
+			v2 = POP();
+			v = POP();
+			push_value(&m, run_binop(bin->binop, v, v2, bin->scratch, e));
+			break;
+
+		case K_LTH_LENGTH:
+			v2 = POP();
+			v = POP();
+			if (is_number(v) && classify(v2) == V_ARY) {
+				++fusion_hits[AST_LTH_LENGTH - AST_INCR];
+				push_value(&m, value2num(v) < value2ary(v2)->len ? VTRUE : VFALSE);
+			} else {
+				push_value(&m, run_binop(TK_LTH, v, run_builtin(BUILTIN_LENGTH, 1, &v2, e), false, e));
+			}
+			break;
+
+		case K_INDEX:
+			v2 = POP();
+			v = POP();
+			push_value(&m, index_into(v, v2));
+			break;
+
+		case K_NEG:
+			push_value(&m, run_neg(POP()));
+			break;
+
+		case K_NOT:
+			push_value(&m, run_not(POP()));
+			break;
+
+		case K_ARY:;
+			const ast_primary *ap = t.node;
+			v = make_array(ap->scratch, ap->amnt, m.vals + m.nvals - ap->amnt, e); // still rooted while it allocates
+			m.nvals -= ap->amnt;
+			push_value(&m, v);
+			break;
+
+		case K_MAP:;
+			const ast_primary *mp = t.node;
+			v = new_map(mp->amnt, m.vals + m.nvals - mp->amnt);
+			m.nvals -= mp->amnt;
+			push_value(&m, v);
+			break;
+
+		case K_CALL:;
+			const ast_primary *call = t.node;
+			if (t.i) {
+				m.nvals -= call->amnt;
+				push_value(&m, run_builtin(t.i, call->amnt, m.vals + m.nvals, e));
+				break;
+			}
+
+			size_t base = m.nvals - call->amnt - 1;
+			if (classify(m.vals[base]) != V_FUNC)
+				die("cannot call invalid value: %llx", m.vals[base]);
+
+			f = value2func(m.vals[base]);
+			if (enter_call(f, call->amnt, m.vals + base + 1, &v, e)) {
+				m.nvals = base;
+				push_value(&m, v);
+				break;
+			}
+
+			task *ft = push_task(&m, K_FUNC, f, base);
+#ifdef BASICAST_JIT
+			ft->heat = e->heat;
+			e->heat = &f->heat;
+#else
+			(void) ft;
+#endif
+			push_task(&m, X_BLOCK, f->block, 0);
+			break;
+
+		case K_FUNC: // fell off the end of the body.
+			push_value(&m, VNULL);
+			m.tasks[m.ntasks++] = t;
+			goto leave;
+		}
+		continue;
+
+	leave: // the K_FUNC on top is done, its result is on top of the value stack.
+		t = m.tasks[--m.ntasks];
+		v = POP();
+		if (!t.node) {
+			gc_pop_roots(&roots);
+			free(m.tasks);
+			free(m.vals);
+			return v;
+		}
+
+		f = (function *) t.node;
+		leave_call(f, f->argc, m.vals + t.mark + 1, v, e);
+#ifdef BASICAST_JIT
+		e->heat = t.heat;
+#endif
+		m.nvals = t.mark;
+		push_value(&m, v);
+	}
+}
@@ -47,11 +47,12 @@ static token parse_identifier(tokenizer *tzr) {
 
 	int len = tzr->stream - start;
 
-	if (!strncmp(start, "true", len)) return (token) { .kind = TK_LITERAL, .v = VTRUE };
-	if (!strncmp(start, "false", len)) return (token) { .kind = TK_LITERAL, .v = VFALSE };
-	if (!strncmp(start, "null", len)) return (token) { .kind = TK_LITERAL, .v = VNULL };
+	#define IS_WORD(str_) (len == strlen(str_) && !strncmp(start, str_, len))
+	if (IS_WORD("true")) return (token) { .kind = TK_LITERAL, .v = VTRUE };
+	if (IS_WORD("false")) return (token) { .kind = TK_LITERAL, .v = VFALSE };
+	if (IS_WORD("null")) return (token) { .kind = TK_LITERAL, .v = VNULL };
 	#define CHECK_FOR_KEYWORD(str_, kind_) \
-		if (!strncmp(start, str_, strlen(str_))) return (token) {.kind= kind_};
+		if (IS_WORD(str_)) return (token) {.kind= kind_};
 	CHECK_FOR_KEYWORD("global", TK_GLOBAL)
 	CHECK_FOR_KEYWORD("function", TK_FUNCTION)
 	CHECK_FOR_KEYWORD("if", TK_IF)
@@ -99,7 +100,7 @@ static token parse_string(tokenizer *tzr) {
 
 	// simple case, just return the original string.
 	if (!was_anything_escaped)
-		return (token) { .kind=TK_LITERAL, .v = str2value(strndup(start, length)) };
+		return (token) { .kind=TK_LITERAL, .v = string_value(strndup(start, length)) };
 
 	// well, something was escaped, so we now need to deal with that.
 	char *str = malloc(length); // note not `+1`, as we're removing at least 1 slash.
@@ -138,7 +139,7 @@ static token parse_string(tokenizer *tzr) {
 	}
 
 	str[stridx] = '\0';
-	return (token) { .kind = TK_LITERAL, .v = str2value(str) };
+	return (token) { .kind = TK_LITERAL, .v = string_value(str) };
 }
 
 token next_token(tokenizer *tzr) {
@@ -168,13 +169,13 @@ token next_token(tokenizer *tzr) {
 		// fallthru
 
 	case '(': case ')': case '[': case ']': case '{': case '}':
-	case ',': case ';': case '*': case '/': case '%':
+	case ',': case ':': case ';': case '*': case '/': case '%':
 	normal:
 		advance(tzr);
 		// fallthru
 
 	case '\0':
-		return (token) { .kind = c };
+		return (token) { .kind = (unsigned char) c };
 	}
 
 	// for more complicated ones, defer to their functions.
@@ -207,6 +208,7 @@ void dump_token(FILE *out, token tkn) {
 	case TK_RBRACE: fprintf(out, "Token(})\n"); break;
 	case TK_ASSIGN: fprintf(out, "Token(=)\n"); break;
 	case TK_COMMA: fprintf(out, "Token(,)\n"); break;
+	case TK_COLON: fprintf(out, "Token(:)\n"); break;
 	case TK_SEMICOLON: fprintf(out, "Token(;)\n"); break;
 	case TK_ADD: fprintf(out, "Token(+)\n"); break;
 	case TK_SUB: fprintf(out, "Token(-)\n"); break;
@@ -19,6 +19,7 @@ typedef enum {
 	TK_RBRACE = '}',
 	TK_ASSIGN = '=',
 	TK_COMMA = ',',
+	TK_COLON = ':',
 	TK_SEMICOLON = ';',
 	TK_ADD = '+',
 	TK_SUB = '-',
@@ -30,7 +31,7 @@ typedef enum {
 	TK_GTH = '>',
 
 	TK_LEQ = TK_LTH + 0x80,
-	TK_GEQ = TK_LEQ + 0x80,
+	TK_GEQ = TK_GTH + 0x80,
 	TK_EQL = TK_ASSIGN + 0x80,
 	TK_NEQ = TK_NOT + 0x80
 } token_kind; 
@@ -2,21 +2,54 @@
 #include <string.h>
 #include "shared.h"
 #include "value.h"
-#include "ast.h"
-#include "env.h"
+#include "run.h"
+#include "memo.h"
+#include "gc.h"
+#include "closure.h"
+#include "hashmap.h"
+#ifdef BASICAST_JIT
+#include "jit.h"
+#endif
 
 void dump_value(FILE *out, value v) {
 	fprintf(out, "<value:%08llx>", v);
 }
 
-typedef struct {
-	char *name, **argv;
-	int argc;
-	ast_block *block;
-} function;
+// two digits at a time, from the back.
+int format_int(char *buf, long long n) {
+	static const char pairs[] =
+		"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+		"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+		"8081828384858687888990919293949596979899";
+
+	char tmp[24], *p = tmp + sizeof(tmp);
+	unsigned long long u = n < 0 ? -(unsigned long long) n : n;
+	while (u >= 100) {
+		p -= 2;
+		memcpy(p, pairs + u % 100 * 2, 2);
+		u /= 100;
+	}
+	if (u >= 10) {
+		p -= 2;
+		memcpy(p, pairs + u * 2, 2);
+	} else {
+		*--p = '0' + u;
+	}
+	if (n < 0) *--p = '-';
+
+	int len = tmp + sizeof(tmp) - p;
+	memcpy(buf, p, len);
+	buf[len] = '\0';
+	return len;
+}
+
+// `classify` of something that isn't a value.
+void basicast_bad_value(value v) {
+	die("unknown value kind %llx", v);
+}
 
 value new_function(char *name, int argc, char **argv, ast_block *block) {	
-	function *f = malloc(sizeof(function));
+	function *f = gc_alloc(GC_FUNC, sizeof(function));
 	f->name = name;
 	f->argc = argc;
 	f->argv = argv;
@@ -25,43 +58,179 @@ value new_function(char *name, int argc, char **argv, ast_block *block) {
 	return (value) f | 1;
 }
 
-value run_block(ast_block *, value *, env *);
-value call_value(value v, int argc, value *argv, env *e) {
-	if (classify(v) != V_FUNC)
-		die("cannot call invalid value: %llx", v);
+value new_native_function(char *name, int argc, value (*native)(value *, env *)) {
+	function *f = gc_alloc(GC_FUNC, sizeof(function));
+	f->name = name;
+	f->argc = argc;
+	f->native = native;
 
-	function *f = (function *) (v & ~1);
+	return (value) f | 1;
+}
+
+value new_array(int len, const value *eles) {
+	value *buf = gc_alloc(GC_VALUES, len * sizeof(value)); // first, see `make_array`
+	array *a = gc_alloc(GC_ARY, sizeof(array));
+	a->eles = memcpy(buf, eles, len * sizeof(value));
+	a->cap = a->len = len;
+	for (int i = 0; i < len; ++i)
+		gc_retain(eles[i]);
+	return ary2value(a);
+}
+
+// everything `call_value` does before running the body: checks, a new frame,
+// and the args bound. returns true if there's no body to run (memoized or
+// compiled), in which case the call is already over and `*ret` is its result.
+bool enter_call(function *f, int argc, value *argv, value *ret, env *e) {
 	if (f->argc != argc)
 		die("argument mismatch for %s: expected %d, got %d", f->name, f->argc, argc);
 
-	++e->sp;
+	push_frame(e);
+
+#ifdef BASICAST_JIT
+	if (!f->native && ++f->heat >= jit_threshold)
+		jit_compile(f, e);
+#endif
+
+	*ret = VNULL;
+	if (f->memo && memo_lookup(f->memo, argc, argv, ret)) {
+		--e->sp;
+		return true;
+	}
+
+	if (f->native) {
+		*ret = f->native(argv, e);
+		leave_call(f, argc, argv, *ret, e);
+		return true;
+	}
+
+	e->stackframes[e->sp].len = 0;
 	for (int i = 0; i < argc; ++i)
 		assign_var(e, f->argv[i], argv[i]);
-	value ret;
-	run_block(f->block, &ret, e);
+	return false;
+}
+
+void leave_call(function *f, int argc, value *argv, value ret, env *e) {
+	if (f->memo) memo_insert(f->memo, argc, argv, ret);
+
+	map *locals = &e->stackframes[e->sp];
+	for (int i = 0; i < locals->len; ++i)
+		gc_release(locals->entries[i].v);
+	locals->len = 0;
 	--e->sp;
+}
+
+value call_value(value v, int argc, value *argv, env *e) {
+	if (classify(v) != V_FUNC)
+		die("cannot call invalid value: %llx", v);
+
+	function *f = value2func(v);
+	value ret;
+	if (enter_call(f, argc, argv, &ret, e))
+		return ret;
+
+#ifdef BASICAST_JIT
+	int *heat = e->heat;
+	e->heat = &f->heat;
+#endif
+	switch (engine) {
+	case ENGINE_TREE:
+		run_block(f->block, &ret, e);
+		break;
+	case ENGINE_CLOSURE:
+		run_function_closures(f, &ret, e);
+		break;
+	case ENGINE_STACK:
+		ret = run_stack(f->block, e);
+		break;
+	}
+#ifdef BASICAST_JIT
+	e->heat = heat;
+#endif
+
+	leave_call(f, argc, argv, ret, e);
 	return ret;
 }
 
 void index_assign(value ary, value idx, value val) {
-	if (classify(ary) != V_ARY) die("can only index assign into arrays");
+	if (classify(ary) == V_MAP) {
+		map_set(ary, idx, val);
+		return;
+	}
+	if (classify(ary) != V_ARY) die("can only index assign into arrays and maps");
 	if (classify(idx) != V_INT) die("you must index with numbers");
 
 	long long i = value2num(idx);
 	array *a = value2ary(ary);
 
 	if (i < 0) die("negative indexing isnt supported rn");
+	unshare_array(a);
 	if (a->len <= i) {
-		if (a->cap <= i)
-			a->eles = realloc(a->eles, (a->cap = i) * sizeof(value));
+		if (a->cap <= i) {
+			value *eles = gc_alloc(GC_VALUES, (a->cap = a->cap * 2 > i ? a->cap * 2 : i + 1) * sizeof(value));
+			a->eles = memcpy(eles, a->eles, a->len * sizeof(value));
+		}
 		while (a->len <= i)
 			a->eles[a->len++] = VNULL;
 	}
 
+	gc_retain(val);
+	gc_release(a->eles[i]);
 	a->eles[i] = val;
+	gc_array_barrier(a);
+}
+
+// call before storing into a: a view, or an array with views of it, gets its
+// own copy of its elements first, so the views never change.
+void unshare_array(array *a) {
+	if (!is_view(a) && !(a->eles && GC_HEADER(a->eles)->flags & GC_SLICED)) return;
+
+	value *eles = gc_alloc(GC_VALUES, a->len * sizeof(value));
+	a->eles = memcpy(eles, a->eles, a->len * sizeof(value)); // read after the alloc, which might've moved them
+	a->cap = a->len;
+	for (int i = 0; i < a->len; ++i)
+		gc_retain(a->eles[i]);
+	gc_array_barrier(a);
+}
+
+// `slice(s, start, len)`: up to `len` characters or elements from `start` on.
+// arrays get a view of the same buffer (which stores into either copy first),
+// strings, being nul terminated, are copied, unless they're short.
+value slice(value v, value start, value len) {
+	if (classify(start) != V_INT || classify(len) != V_INT || value2num(start) < 0 || value2num(len) < 0)
+		die("usage: slice(string or array, start, len)");
+
+	long long from = value2num(start), n = value2num(len);
+	switch (classify(v)) {
+	case V_STR:;
+		char buf[8];
+		const char *s = str_chars(v, buf);
+		size_t total = strlen(s);
+		if (from > total) from = total;
+		if (n > total - from) n = total - from;
+		if (n <= SHORT_STR_MAX) return short_str(s + from, n);
+
+		char *c = gc_alloc(GC_STR, n + 1);
+		memcpy(c, s + from, n);
+		c[n] = '\0';
+		return str2value(c);
+
+	case V_ARY:;
+		array *view = gc_alloc(GC_ARY, sizeof(array)), *a = value2ary(v);
+		if (from > a->len) from = a->len;
+		if (n > a->len - from) n = a->len - from;
+		view->eles = a->eles + from;
+		view->len = n;
+		view->cap = -(view->eles - ary_buffer(a)) - 1;
+		if (a->eles) GC_HEADER(ary_buffer(a))->flags |= GC_SLICED;
+		return ary2value(view);
+
+	default:
+		die("can only slice strings and arrays");
+	}
 }
 
 value index_into(value ary, value idx) {
+	if (classify(ary) == V_MAP) return map_get(ary, idx);
 	if (classify(idx) != V_INT) die("you must index with numbers");
 
 	long long i = value2num(idx);
@@ -69,17 +238,15 @@ value index_into(value ary, value idx) {
 
 	switch (classify(ary)) {
 	case V_STR:;
-		char *s = value2str(ary);
+		char buf[8];
+		const char *s = str_chars(ary, buf);
 		if (strlen(s) <= i) return VNULL;
-		char *c = malloc(2);
-		c[0] = s[i];
-		c[1] = '\0';
-		return str2value(c);
+		return short_str(s + i, 1);
 
 	case V_ARY:;
 		array *a = value2ary(ary);
 		return a->len <= i ? VNULL : a->eles[i];
 	default:
-		die("can only index into arrays or strs");
+		die("can only index into arrays, strs or maps");
 	}
 }
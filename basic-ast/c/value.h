@@ -1,7 +1,10 @@
 #pragma once
 #include <stdio.h>
+#include <stdbool.h>
 #include <assert.h>
+#include <string.h>
 #include "shared.h"
+#include "basicast.h" // `value`, its constants, `classify`, `num2value`, `value2num` and `str_chars`
 
 /*
 00...000 = VFALSE
@@ -11,17 +14,15 @@ XX...100 = number
 XX...000 = string
 XX...001 = function
 XX...010 = ary
+XX...110 = short string
+XX...101 = map
 */
 
-typedef long long value;
 typedef struct {
-	int cap, len;
+	int cap, len; // a negative cap makes this a view, see `slice`
 	value *eles;
 } array;
 
-#define VFALSE 0
-#define VNULL 1
-#define VTRUE 2
 #define VUNDEF 3
 
 static inline value ary2value(array *a) {
@@ -32,12 +33,29 @@ static inline array *value2ary(value v) {
 	return (array *) (v & ~2);
 }
 
-static inline value num2value(long long n) {
-	return (n << 3) | 4;
+// see `hashmap.c`.
+typedef struct {
+	int len, cap, deleted; // entries, slots (0 or a power of 2, at least 16), and tombstones
+	unsigned char *ctrl; // a control byte per slot, then each slot's hash
+	value *slots; // key, value, key, value...
+} hashmap;
+
+static inline value map2value(hashmap *m) {
+	return (value) m | 5;
+}
+static inline hashmap *value2map(value v) {
+	assert((v & 7) == 5);
+	return (hashmap *) (v & ~5);
 }
 
-static inline long long value2num(value v) {
-	return (long long) v >> 3;
+// an array made by `slice` shares its parent's buffer, `eles` pointing `-cap - 1`
+// values into it, and the buffer's marked GC_SLICED. neither stores into it
+// after that, see `unshare_array`, so a view's always what it was when made.
+static inline bool is_view(const array *a) {
+	return a->cap < 0;
+}
+static inline value *ary_buffer(const array *a) {
+	return a->cap < 0 ? a->eles + a->cap + 1 : a->eles;
 }
 
 static inline value str2value(char *s) {
@@ -49,14 +67,26 @@ static inline char *value2str(value v) {
 	return (char*)v;
 }
 
-static inline enum { V_INT, V_STR, V_BOOL, V_NULL, V_ARY, V_FUNC } classify(value v) {
-	if (v == VNULL) return V_NULL;
-	if (v == VTRUE || v==VFALSE) return V_BOOL;
-	if ((v & 7) == 4) return V_INT;
-	if ((v & 7) == 0) return V_STR;
-	if ((v & 7) == 2) return V_ARY;
-	if ((v & 7) == 1) return V_FUNC;
-	die("unknown value kind %llx", v);
+// strings of up to 7 bytes live in the value itself: the length in bits 3-5 and
+// the characters, in order, in the bytes above (this assumes little endian).
+// every string that short is kept like this, so two are equal iff their values are.
+#define SHORT_STR_MAX 7
+static inline bool is_short_str(value v) {
+	return (v & 7) == 6;
+}
+static inline value short_str(const char *s, size_t len) {
+	value v = 0;
+	memcpy((char *) &v + 1, s, len);
+	return v | len << 3 | 6;
+}
+static inline size_t short_str_len(value v) {
+	return v >> 3 & 7;
+}
+
+// `s` as a string value, short if it fits.
+static inline value string_value(char *s) {
+	size_t len = strlen(s);
+	return len <= SHORT_STR_MAX ? short_str(s, len) : str2value(s);
 }
 
 static inline int value2bool(value v) {
@@ -69,10 +99,37 @@ static inline int is_number(value v) {
 
 void dump_value(FILE *out, value v);
 
+int format_int(char *buf, long long n); // writes n and a '\0' to buf (24 bytes is enough), returns its length
+
 struct ast_block;
+struct env;
+typedef struct {
+	char *name, **argv;
+	int argc;
+	struct ast_block *block;
+
+	int heat; // calls + back-edges so far; once it's high enough, the JIT kicks in.
+	value (*native)(value *argv, struct env *e); // compiled code, if any.
+	size_t native_size; // the size of the JIT's mapping `native` points at, 0 if it's not the JIT's
+
+	bool pure; // see `purity.c`
+	struct memo *memo; // cached results, only ever set for pure functions.
+	struct closure_function *closures; // see `closure.c`, built on the first call.
+} function;
+
+static inline function *value2func(value v) {
+	assert((v & 7) == 1);
+	return (function *) (v & ~1);
+}
+
 value new_function(char *name, int argc, char **argv, struct ast_block *block);
+value new_native_function(char *name, int argc, value (*native)(value *argv, struct env *e));
+value new_array(int len, const value *eles);
 void index_assign(value ary, value idx, value val);
+value slice(value v, value start, value len);
+void unshare_array(array *a);
 value index_into(value ary, value idx);
-struct env;
 value call_value(value v, int argc, value *argv, struct env *e);
+bool enter_call(function *f, int argc, value *argv, value *ret, struct env *e);
+void leave_call(function *f, int argc, value *argv, value ret, struct env *e);
 
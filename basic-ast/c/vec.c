@@ -0,0 +1,357 @@
+#include "vec.h"
+#include "gc.h"
+#include "run.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#include <pthread.h>
+#endif
+
+/*
+ * Whole-array builtins: `sum`, `min`, `max`, `fill`, `dot`, `map_add`,
+ * `map_mul` and `find`, and comparing arrays.
+ *
+ * Arrays keep their ints tagged, but a tagged int (`n << 3 | 4`) is still just
+ * a 64 bit lane: tagged ints order like the ints they hold, adding `k << 3`
+ * adds k, and `(v - 4) * k` is `(n * k) << 3`. So the kernels work on the
+ * elements as they are, checking tags along the way, with no unboxed copy to
+ * keep in sync. Each has an AVX2 version and a scalar one; which gets used is
+ * decided on first use, by what the cpu supports (`BASICAST_SIMD=0` forces the
+ * scalar ones).
+ *
+ * Comparisons skip ahead to the first pair of elements that aren't the same
+ * value, four at a time, and only look at what they hold from there: that's
+ * where ints and short strings differ, and anything else might still be equal.
+ */
+
+// anything but an int makes this nonzero.
+#define NOT_INT(v) (((v) & 7) ^ 4)
+
+/* scalar */
+
+static unsigned long long sum_scalar(const value *v, int n, bool *ints) {
+	unsigned long long sum = 0, bad = 0;
+	for (int i = 0; i < n; ++i) {
+		sum += v[i];
+		bad |= NOT_INT(v[i]);
+	}
+	*ints = !bad;
+	return sum;
+}
+
+static value minmax_scalar(const value *v, int n, bool max, bool *ints) {
+	value m = v[0], bad = 0;
+	for (int i = 0; i < n; ++i) {
+		if (max ? v[i] > m : v[i] < m) m = v[i];
+		bad |= NOT_INT(v[i]);
+	}
+	*ints = !bad;
+	return m;
+}
+
+// sum of `(a >> 3) * (b - 4)`, which is the dot product shifted left by 3.
+// the shift's unsigned, as it would be in AVX2: the bits it gets wrong are
+// all multiplied past the top of the result anyway.
+static unsigned long long dot_scalar(const value *a, const value *b, int n, bool *ints) {
+	unsigned long long dot = 0, bad = 0;
+	for (int i = 0; i < n; ++i) {
+		dot += ((unsigned long long) a[i] >> 3) * (b[i] - 4);
+		bad |= NOT_INT(a[i]) | NOT_INT(b[i]);
+	}
+	*ints = !bad;
+	return dot;
+}
+
+static void map_scalar(value *dst, const value *src, int n, value k, bool mul, bool *ints) {
+	unsigned long long bad = 0;
+	for (int i = 0; i < n; ++i) {
+		dst[i] = mul ? ((unsigned long long) src[i] - 4) * value2num(k) | 4 : (unsigned long long) src[i] + k - 4;
+		bad |= NOT_INT(src[i]);
+	}
+	*ints = !bad;
+}
+
+static void fill_scalar(value *dst, int n, value x) {
+	for (int i = 0; i < n; ++i)
+		dst[i] = x;
+}
+
+static int find_scalar(const value *v, int n, value x) {
+	for (int i = 0; i < n; ++i)
+		if (v[i] == x) return i;
+	return -1;
+}
+
+// the first i where a[i] and b[i] aren't the same value, or n.
+static int mismatch_scalar(const value *a, const value *b, int n) {
+	int i = 0;
+	while (i < n && a[i] == b[i]) ++i;
+	return i;
+}
+
+/* AVX2 */
+
+#ifdef __x86_64__
+#define AVX2 __attribute__((target("avx2")))
+#define LOAD(p) _mm256_loadu_si256((const __m256i *) (p))
+
+AVX2 static __m256i not_int(__m256i v) {
+	return _mm256_xor_si256(_mm256_and_si256(v, _mm256_set1_epi64x(7)), _mm256_set1_epi64x(4));
+}
+
+// the low 64 bits of each product, there's no 64 bit multiply before AVX-512.
+AVX2 static __m256i mul64(__m256i a, __m256i b) {
+	__m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b), _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+	return _mm256_add_epi64(_mm256_mul_epu32(a, b), _mm256_slli_epi64(cross, 32));
+}
+
+AVX2 static unsigned long long hsum(__m256i v) {
+	unsigned long long lanes[4];
+	_mm256_storeu_si256((__m256i *) lanes, v);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+AVX2 static unsigned long long sum_avx2(const value *v, int n, bool *ints) {
+	__m256i sum = _mm256_setzero_si256(), bad = sum;
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256i x = LOAD(v + i);
+		sum = _mm256_add_epi64(sum, x);
+		bad = _mm256_or_si256(bad, not_int(x));
+	}
+
+	unsigned long long tail = sum_scalar(v + i, n - i, ints);
+	*ints = *ints && _mm256_testz_si256(bad, bad);
+	return hsum(sum) + tail;
+}
+
+AVX2 static value minmax_avx2(const value *v, int n, bool max, bool *ints) {
+	if (n < 4) return minmax_scalar(v, n, max, ints);
+
+	__m256i m = LOAD(v), bad = not_int(m);
+	int i = 4;
+	for (; i + 4 <= n; i += 4) {
+		__m256i x = LOAD(v + i), gt = _mm256_cmpgt_epi64(x, m);
+		m = max ? _mm256_blendv_epi8(m, x, gt) : _mm256_blendv_epi8(x, m, gt);
+		bad = _mm256_or_si256(bad, not_int(x));
+	}
+
+	value lanes[4];
+	_mm256_storeu_si256((__m256i *) lanes, m);
+	value result = minmax_scalar(lanes, 4, max, ints);
+	if (i < n) {
+		value tail = minmax_scalar(v + i, n - i, max, ints);
+		if (max ? tail > result : tail < result) result = tail;
+	}
+	*ints = *ints && _mm256_testz_si256(bad, bad);
+	return result;
+}
+
+AVX2 static unsigned long long dot_avx2(const value *a, const value *b, int n, bool *ints) {
+	__m256i dot = _mm256_setzero_si256(), bad = dot, four = _mm256_set1_epi64x(4);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256i x = LOAD(a + i), y = LOAD(b + i);
+		dot = _mm256_add_epi64(dot, mul64(_mm256_srli_epi64(x, 3), _mm256_sub_epi64(y, four)));
+		bad = _mm256_or_si256(bad, _mm256_or_si256(not_int(x), not_int(y)));
+	}
+
+	unsigned long long tail = dot_scalar(a + i, b + i, n - i, ints);
+	*ints = *ints && _mm256_testz_si256(bad, bad);
+	return hsum(dot) + tail;
+}
+
+AVX2 static void map_avx2(value *dst, const value *src, int n, value k, bool mul, bool *ints) {
+	__m256i four = _mm256_set1_epi64x(4), by = _mm256_set1_epi64x(mul ? value2num(k) : k - 4), bad = _mm256_setzero_si256();
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256i x = LOAD(src + i);
+		__m256i y = mul ? _mm256_or_si256(mul64(_mm256_sub_epi64(x, four), by), four) : _mm256_add_epi64(x, by);
+		_mm256_storeu_si256((__m256i *) (dst + i), y);
+		bad = _mm256_or_si256(bad, not_int(x));
+	}
+
+	map_scalar(dst + i, src + i, n - i, k, mul, ints);
+	*ints = *ints && _mm256_testz_si256(bad, bad);
+}
+
+AVX2 static void fill_avx2(value *dst, int n, value x) {
+	__m256i v = _mm256_set1_epi64x(x);
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+		_mm256_storeu_si256((__m256i *) (dst + i), v);
+	fill_scalar(dst + i, n - i, x);
+}
+
+AVX2 static int find_avx2(const value *v, int n, value x) {
+	__m256i want = _mm256_set1_epi64x(x);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		int hits = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(LOAD(v + i), want)));
+		if (hits) return i + __builtin_ctz(hits);
+	}
+
+	int j = find_scalar(v + i, n - i, x);
+	return j < 0 ? -1 : i + j;
+}
+
+AVX2 static int mismatch_avx2(const value *a, const value *b, int n) {
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		int same = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(LOAD(a + i), LOAD(b + i))));
+		if (same != 0xF) return i + __builtin_ctz(~same);
+	}
+	return i + mismatch_scalar(a + i, b + i, n - i);
+}
+
+static bool avx2;
+static pthread_once_t avx2_checked = PTHREAD_ONCE_INIT; // once for every thread, see `basicast.h`
+
+static void check_avx2(void) {
+	char *simd = getenv("BASICAST_SIMD");
+	avx2 = (!simd || atoi(simd)) && __builtin_cpu_supports("avx2");
+}
+
+static bool use_avx2(void) {
+	pthread_once(&avx2_checked, check_avx2);
+	return avx2;
+}
+
+#define PICK(kernel, ...) (use_avx2() ? kernel##_avx2(__VA_ARGS__) : kernel##_scalar(__VA_ARGS__))
+#else
+#define PICK(kernel, ...) kernel##_scalar(__VA_ARGS__)
+#endif
+
+/* the builtins */
+
+static array *array_arg(value a, const char *name) {
+	if (classify(a) != V_ARY) die("%s needs an array of ints", name);
+	return value2ary(a);
+}
+
+value array_sum(value av) {
+	array *a = array_arg(av, "sum");
+	bool ints;
+	unsigned long long sum = PICK(sum, a->eles, a->len, &ints);
+	if (!ints) die("sum needs an array of ints");
+	return (sum - 4ULL * a->len) | 4; // each element brought a 4 along
+}
+
+value array_min(value av, bool max) {
+	array *a = array_arg(av, max ? "max" : "min");
+	if (!a->len) return VNULL;
+
+	bool ints;
+	value m = PICK(minmax, a->eles, a->len, max, &ints);
+	if (!ints) die("%s needs an array of ints", max ? "max" : "min");
+	return m;
+}
+
+value array_dot(value av, value bv) {
+	array *a = array_arg(av, "dot"), *b = array_arg(bv, "dot");
+	if (a->len != b->len) die("dot needs arrays of the same length");
+
+	bool ints;
+	unsigned long long dot = PICK(dot, a->eles, b->eles, a->len, &ints);
+	if (!ints) die("dot needs arrays of ints");
+	return dot | 4;
+}
+
+// `map_add(a, k)` and `map_mul(a, k)`: a new array, with k added to or multiplied into each element.
+value array_map(value av, value k, bool mul) {
+	array_arg(av, mul ? "map_mul" : "map_add");
+	if (classify(k) != V_INT) die("%s needs an int to map by", mul ? "map_mul" : "map_add");
+
+	int len = value2ary(av)->len;
+	value *buf = gc_alloc(GC_VALUES, len * sizeof(value)); // first, see `make_array`
+	array *out = gc_alloc(GC_ARY, sizeof(array)), *a = value2ary(av);
+
+	bool ints;
+	PICK(map, buf, a->eles, len, k, mul, &ints);
+	if (!ints) die("%s needs an array of ints", mul ? "map_mul" : "map_add");
+	out->eles = buf;
+	out->cap = out->len = len;
+	return ary2value(out);
+}
+
+// `fill(a, x)`: stores x into every element of a, and returns a.
+value array_fill(value av, value x) {
+	if (classify(av) != V_ARY) die("can only fill arrays");
+	array *a = value2ary(av);
+	unshare_array(a);
+
+	// nothing to release if it's all ints, which is the case worth being quick about.
+	bool ints;
+	PICK(sum, a->eles, a->len, &ints);
+	for (int i = 0; !ints && i < a->len; ++i)
+		gc_release(a->eles[i]);
+	for (int i = 0; GC_POINTER(x) && i < a->len; ++i)
+		gc_retain(x);
+
+	PICK(fill, a->eles, a->len, x);
+	gc_array_barrier(a);
+	return av;
+}
+
+// `find(a, x)`: the index of the first element equal to x, or -1.
+value array_find(value av, value x, struct env *e) {
+	if (classify(av) != V_ARY) die("can only find things in arrays");
+	array *a = value2ary(av);
+
+	// only strings and arrays can be equal without being the same value.
+	if (classify(x) == V_ARY || (classify(x) == V_STR && !is_short_str(x))) {
+		for (int i = 0; i < a->len; ++i)
+			if (run_binop(TK_EQL, a->eles[i], x, false, e) == VTRUE)
+				return num2value(i);
+		return num2value(-1);
+	}
+
+	return num2value(PICK(find, a->eles, a->len, x));
+}
+
+// whether two elements that aren't the same value are equal anyway.
+static bool equal_anyway(value x, value y) {
+	if (classify(x) != classify(y)) return false;
+	if (classify(x) == V_ARY) return array_equal(x, y);
+	return classify(x) == V_STR && !is_short_str(x) && !is_short_str(y) && !strcmp(value2str(x), value2str(y));
+}
+
+bool array_equal(value av, value bv) {
+	if (av == bv) return true;
+
+	array *a = value2ary(av), *b = value2ary(bv);
+	if (a->len != b->len) return false;
+
+	for (int i = 0; i < a->len; ++i) {
+		i += PICK(mismatch, a->eles + i, b->eles + i, a->len - i);
+		if (i < a->len && !equal_anyway(a->eles[i], b->eles[i]))
+			return false;
+	}
+	return true;
+}
+
+int compare_values(value x, value y) {
+	if (classify(x) != classify(y)) die("can only compare like types");
+
+	switch (classify(x)) {
+	case V_INT: return (x > y) - (x < y);
+	case V_STR: return compare_strings(x, y);
+	case V_ARY: return array_compare(x, y);
+	default: die("can only compare ints, strings and arrays");
+	}
+}
+
+int array_compare(value av, value bv) {
+	if (av == bv) return 0;
+
+	array *a = value2ary(av), *b = value2ary(bv);
+	int n = a->len < b->len ? a->len : b->len;
+	for (int i = 0; i < n; ++i) {
+		if ((i += PICK(mismatch, a->eles + i, b->eles + i, n - i)) == n) break;
+
+		int cmp = compare_values(a->eles[i], b->eles[i]);
+		if (cmp) return cmp;
+	}
+	return (a->len > b->len) - (a->len < b->len);
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include "value.h"
+
+// whole-array builtins over ints, vectorized where the cpu allows, see `vec.c`.
+struct env;
+value array_sum(value a);
+value array_min(value a, bool max);
+value array_fill(value a, value x);
+value array_dot(value a, value b);
+value array_map(value a, value k, bool mul);
+value array_find(value a, value x, struct env *e);
+
+// `==` and `<` and co. on arrays: element by element, then by length.
+bool array_equal(value a, value b);
+int array_compare(value a, value b); // like `strcmp`
+int compare_values(value a, value b); // what `<` goes by: ints, strings and arrays, each with their own kind